@@ -35,13 +35,13 @@ void extract_text(FILE *batch_file) {
 	}
 }
 
-// Puts grep command into batch file
-// Single grep command for all files
+// Puts the shell's wordfreq builtin into batch file
+// Single wordfreq command counts and sorts the words of all files
 void find_words(FILE *batch_file) {
 	char i, j;
 
-	// Put the beginning of the grep command into the batch file
-	if ((fprintf(batch_file, "grep -oh \"[a-zA-Z]*\" ")) < 0) {
+	// Put the beginning of the wordfreq command into the batch file
+	if ((fprintf(batch_file, "wordfreq ")) < 0) {
 		perror("fprintf");
 		exit(EXIT_FAILURE);
 	}
@@ -56,7 +56,7 @@ void find_words(FILE *batch_file) {
 		}
 	}	
 
-	// Put the beginning of the grep command into the batch file
+	// Put the end of the wordfreq command into the batch file
 	if ((fprintf(batch_file, "> allword.txt\n")) < 0) {
 		perror("fprintf");
 		exit(EXIT_FAILURE);
@@ -1350,4 +1350,4 @@ lynx -dump -nolist ZW.html > ZW.txt
 lynx -dump -nolist ZX.html > ZX.txt
 lynx -dump -nolist ZY.html > ZY.txt
 lynx -dump -nolist ZZ.html > ZZ.txt
-grep -oh "[a-zA-Z]*" AA.txt AB.txt AC.txt AD.txt AE.txt AF.txt AG.txt AH.txt AI.txt AJ.txt AK.txt AL.txt AM.txt AN.txt AO.txt AP.txt AQ.txt AR.txt AS.txt AT.txt AU.txt AV.txt AW.txt AX.txt AY.txt AZ.txt BA.txt BB.txt BC.txt BD.txt BE.txt BF.txt BG.txt BH.txt BI.txt BJ.txt BK.txt BL.txt BM.txt BN.txt BO.txt BP.txt BQ.txt BR.txt BS.txt BT.txt BU.txt BV.txt BW.txt BX.txt BY.txt BZ.txt CA.txt CB.txt CC.txt CD.txt CE.txt CF.txt CG.txt CH.txt CI.txt CJ.txt CK.txt CL.txt CM.txt CN.txt CO.txt CP.txt CQ.txt CR.txt CS.txt CT.txt CU.txt CV.txt CW.txt CX.txt CY.txt CZ.txt DA.txt DB.txt DC.txt DD.txt DE.txt DF.txt DG.txt DH.txt DI.txt DJ.txt DK.txt DL.txt DM.txt DN.txt DO.txt DP.txt DQ.txt DR.txt DS.txt DT.txt DU.txt DV.txt DW.txt DX.txt DY.txt DZ.txt EA.txt EB.txt EC.txt ED.txt EE.txt EF.txt EG.txt EH.txt EI.txt EJ.txt EK.txt EL.txt EM.txt EN.txt EO.txt EP.txt EQ.txt ER.txt ES.txt ET.txt EU.txt EV.txt EW.txt EX.txt EY.txt EZ.txt FA.txt FB.txt FC.txt FD.txt FE.txt FF.txt FG.txt FH.txt FI.txt FJ.txt FK.txt FL.txt FM.txt FN.txt FO.txt FP.txt FQ.txt FR.txt FS.txt FT.txt FU.txt FV.txt FW.txt FX.txt FY.txt FZ.txt GA.txt GB.txt GC.txt GD.txt GE.txt GF.txt GG.txt GH.txt GI.txt GJ.txt GK.txt GL.txt GM.txt GN.txt GO.txt GP.txt GQ.txt GR.txt GS.txt GT.txt GU.txt GV.txt GW.txt GX.txt GY.txt GZ.txt HA.txt HB.txt HC.txt HD.txt HE.txt HF.txt HG.txt HH.txt HI.txt HJ.txt HK.txt HL.txt HM.txt HN.txt HO.txt HP.txt HQ.txt HR.txt HS.txt HT.txt HU.txt HV.txt HW.txt HX.txt HY.txt HZ.txt IA.txt IB.txt IC.txt ID.txt IE.txt IF.txt IG.txt IH.txt II.txt IJ.txt IK.txt IL.txt IM.txt IN.txt IO.txt IP.txt IQ.txt IR.txt IS.txt IT.txt IU.txt IV.txt IW.txt IX.txt IY.txt IZ.txt JA.txt JB.txt JC.txt JD.txt JE.txt JF.txt JG.txt JH.txt JI.txt JJ.txt JK.txt JL.txt JM.txt JN.txt JO.txt JP.txt JQ.txt JR.txt JS.txt JT.txt JU.txt JV.txt JW.txt JX.txt JY.txt JZ.txt KA.txt KB.txt KC.txt KD.txt KE.txt KF.txt KG.txt KH.txt KI.txt KJ.txt KK.txt KL.txt KM.txt KN.txt KO.txt KP.txt KQ.txt KR.txt KS.txt KT.txt KU.txt KV.txt KW.txt KX.txt KY.txt KZ.txt LA.txt LB.txt LC.txt LD.txt LE.txt LF.txt LG.txt LH.txt LI.txt LJ.txt LK.txt LL.txt LM.txt LN.txt LO.txt LP.txt LQ.txt LR.txt LS.txt LT.txt LU.txt LV.txt LW.txt LX.txt LY.txt LZ.txt MA.txt MB.txt MC.txt MD.txt ME.txt MF.txt MG.txt MH.txt MI.txt MJ.txt MK.txt ML.txt MM.txt MN.txt MO.txt MP.txt MQ.txt MR.txt MS.txt MT.txt MU.txt MV.txt MW.txt MX.txt MY.txt MZ.txt NA.txt NB.txt NC.txt ND.txt NE.txt NF.txt NG.txt NH.txt NI.txt NJ.txt NK.txt NL.txt NM.txt NN.txt NO.txt NP.txt NQ.txt NR.txt NS.txt NT.txt NU.txt NV.txt NW.txt NX.txt NY.txt NZ.txt OA.txt OB.txt OC.txt OD.txt OE.txt OF.txt OG.txt OH.txt OI.txt OJ.txt OK.txt OL.txt OM.txt ON.txt OO.txt OP.txt OQ.txt OR.txt OS.txt OT.txt OU.txt OV.txt OW.txt OX.txt OY.txt OZ.txt PA.txt PB.txt PC.txt PD.txt PE.txt PF.txt PG.txt PH.txt PI.txt PJ.txt PK.txt PL.txt PM.txt PN.txt PO.txt PP.txt PQ.txt PR.txt PS.txt PT.txt PU.txt PV.txt PW.txt PX.txt PY.txt PZ.txt QA.txt QB.txt QC.txt QD.txt QE.txt QF.txt QG.txt QH.txt QI.txt QJ.txt QK.txt QL.txt QM.txt QN.txt QO.txt QP.txt QQ.txt QR.txt QS.txt QT.txt QU.txt QV.txt QW.txt QX.txt QY.txt QZ.txt RA.txt RB.txt RC.txt RD.txt RE.txt RF.txt RG.txt RH.txt RI.txt RJ.txt RK.txt RL.txt RM.txt RN.txt RO.txt RP.txt RQ.txt RR.txt RS.txt RT.txt RU.txt RV.txt RW.txt RX.txt RY.txt RZ.txt SA.txt SB.txt SC.txt SD.txt SE.txt SF.txt SG.txt SH.txt SI.txt SJ.txt SK.txt SL.txt SM.txt SN.txt SO.txt SP.txt SQ.txt SR.txt SS.txt ST.txt SU.txt SV.txt SW.txt SX.txt SY.txt SZ.txt TA.txt TB.txt TC.txt TD.txt TE.txt TF.txt TG.txt TH.txt TI.txt TJ.txt TK.txt TL.txt TM.txt TN.txt TO.txt TP.txt TQ.txt TR.txt TS.txt TT.txt TU.txt TV.txt TW.txt TX.txt TY.txt TZ.txt UA.txt UB.txt UC.txt UD.txt UE.txt UF.txt UG.txt UH.txt UI.txt UJ.txt UK.txt UL.txt UM.txt UN.txt UO.txt UP.txt UQ.txt UR.txt US.txt UT.txt UU.txt UV.txt UW.txt UX.txt UY.txt UZ.txt VA.txt VB.txt VC.txt VD.txt VE.txt VF.txt VG.txt VH.txt VI.txt VJ.txt VK.txt VL.txt VM.txt VN.txt VO.txt VP.txt VQ.txt VR.txt VS.txt VT.txt VU.txt VV.txt VW.txt VX.txt VY.txt VZ.txt WA.txt WB.txt WC.txt WD.txt WE.txt WF.txt WG.txt WH.txt WI.txt WJ.txt WK.txt WL.txt WM.txt WN.txt WO.txt WP.txt WQ.txt WR.txt WS.txt WT.txt WU.txt WV.txt WW.txt WX.txt WY.txt WZ.txt XA.txt XB.txt XC.txt XD.txt XE.txt XF.txt XG.txt XH.txt XI.txt XJ.txt XK.txt XL.txt XM.txt XN.txt XO.txt XP.txt XQ.txt XR.txt XS.txt XT.txt XU.txt XV.txt XW.txt XX.txt XY.txt XZ.txt YA.txt YB.txt YC.txt YD.txt YE.txt YF.txt YG.txt YH.txt YI.txt YJ.txt YK.txt YL.txt YM.txt YN.txt YO.txt YP.txt YQ.txt YR.txt YS.txt YT.txt YU.txt YV.txt YW.txt YX.txt YY.txt YZ.txt ZA.txt ZB.txt ZC.txt ZD.txt ZE.txt ZF.txt ZG.txt ZH.txt ZI.txt ZJ.txt ZK.txt ZL.txt ZM.txt ZN.txt ZO.txt ZP.txt ZQ.txt ZR.txt ZS.txt ZT.txt ZU.txt ZV.txt ZW.txt ZX.txt ZY.txt ZZ.txt > allword.txt
+wordfreq AA.txt AB.txt AC.txt AD.txt AE.txt AF.txt AG.txt AH.txt AI.txt AJ.txt AK.txt AL.txt AM.txt AN.txt AO.txt AP.txt AQ.txt AR.txt AS.txt AT.txt AU.txt AV.txt AW.txt AX.txt AY.txt AZ.txt BA.txt BB.txt BC.txt BD.txt BE.txt BF.txt BG.txt BH.txt BI.txt BJ.txt BK.txt BL.txt BM.txt BN.txt BO.txt BP.txt BQ.txt BR.txt BS.txt BT.txt BU.txt BV.txt BW.txt BX.txt BY.txt BZ.txt CA.txt CB.txt CC.txt CD.txt CE.txt CF.txt CG.txt CH.txt CI.txt CJ.txt CK.txt CL.txt CM.txt CN.txt CO.txt CP.txt CQ.txt CR.txt CS.txt CT.txt CU.txt CV.txt CW.txt CX.txt CY.txt CZ.txt DA.txt DB.txt DC.txt DD.txt DE.txt DF.txt DG.txt DH.txt DI.txt DJ.txt DK.txt DL.txt DM.txt DN.txt DO.txt DP.txt DQ.txt DR.txt DS.txt DT.txt DU.txt DV.txt DW.txt DX.txt DY.txt DZ.txt EA.txt EB.txt EC.txt ED.txt EE.txt EF.txt EG.txt EH.txt EI.txt EJ.txt EK.txt EL.txt EM.txt EN.txt EO.txt EP.txt EQ.txt ER.txt ES.txt ET.txt EU.txt EV.txt EW.txt EX.txt EY.txt EZ.txt FA.txt FB.txt FC.txt FD.txt FE.txt FF.txt FG.txt FH.txt FI.txt FJ.txt FK.txt FL.txt FM.txt FN.txt FO.txt FP.txt FQ.txt FR.txt FS.txt FT.txt FU.txt FV.txt FW.txt FX.txt FY.txt FZ.txt GA.txt GB.txt GC.txt GD.txt GE.txt GF.txt GG.txt GH.txt GI.txt GJ.txt GK.txt GL.txt GM.txt GN.txt GO.txt GP.txt GQ.txt GR.txt GS.txt GT.txt GU.txt GV.txt GW.txt GX.txt GY.txt GZ.txt HA.txt HB.txt HC.txt HD.txt HE.txt HF.txt HG.txt HH.txt HI.txt HJ.txt HK.txt HL.txt HM.txt HN.txt HO.txt HP.txt HQ.txt HR.txt HS.txt HT.txt HU.txt HV.txt HW.txt HX.txt HY.txt HZ.txt IA.txt IB.txt IC.txt ID.txt IE.txt IF.txt IG.txt IH.txt II.txt IJ.txt IK.txt IL.txt IM.txt IN.txt IO.txt IP.txt IQ.txt IR.txt IS.txt IT.txt IU.txt IV.txt IW.txt IX.txt IY.txt IZ.txt JA.txt JB.txt JC.txt JD.txt JE.txt JF.txt JG.txt JH.txt JI.txt JJ.txt JK.txt JL.txt JM.txt JN.txt JO.txt JP.txt JQ.txt JR.txt JS.txt JT.txt JU.txt JV.txt JW.txt JX.txt JY.txt JZ.txt KA.txt KB.txt KC.txt KD.txt KE.txt KF.txt KG.txt KH.txt KI.txt KJ.txt KK.txt KL.txt KM.txt KN.txt KO.txt KP.txt KQ.txt KR.txt KS.txt KT.txt KU.txt KV.txt KW.txt KX.txt KY.txt KZ.txt LA.txt LB.txt LC.txt LD.txt LE.txt LF.txt LG.txt LH.txt LI.txt LJ.txt LK.txt LL.txt LM.txt LN.txt LO.txt LP.txt LQ.txt LR.txt LS.txt LT.txt LU.txt LV.txt LW.txt LX.txt LY.txt LZ.txt MA.txt MB.txt MC.txt MD.txt ME.txt MF.txt MG.txt MH.txt MI.txt MJ.txt MK.txt ML.txt MM.txt MN.txt MO.txt MP.txt MQ.txt MR.txt MS.txt MT.txt MU.txt MV.txt MW.txt MX.txt MY.txt MZ.txt NA.txt NB.txt NC.txt ND.txt NE.txt NF.txt NG.txt NH.txt NI.txt NJ.txt NK.txt NL.txt NM.txt NN.txt NO.txt NP.txt NQ.txt NR.txt NS.txt NT.txt NU.txt NV.txt NW.txt NX.txt NY.txt NZ.txt OA.txt OB.txt OC.txt OD.txt OE.txt OF.txt OG.txt OH.txt OI.txt OJ.txt OK.txt OL.txt OM.txt ON.txt OO.txt OP.txt OQ.txt OR.txt OS.txt OT.txt OU.txt OV.txt OW.txt OX.txt OY.txt OZ.txt PA.txt PB.txt PC.txt PD.txt PE.txt PF.txt PG.txt PH.txt PI.txt PJ.txt PK.txt PL.txt PM.txt PN.txt PO.txt PP.txt PQ.txt PR.txt PS.txt PT.txt PU.txt PV.txt PW.txt PX.txt PY.txt PZ.txt QA.txt QB.txt QC.txt QD.txt QE.txt QF.txt QG.txt QH.txt QI.txt QJ.txt QK.txt QL.txt QM.txt QN.txt QO.txt QP.txt QQ.txt QR.txt QS.txt QT.txt QU.txt QV.txt QW.txt QX.txt QY.txt QZ.txt RA.txt RB.txt RC.txt RD.txt RE.txt RF.txt RG.txt RH.txt RI.txt RJ.txt RK.txt RL.txt RM.txt RN.txt RO.txt RP.txt RQ.txt RR.txt RS.txt RT.txt RU.txt RV.txt RW.txt RX.txt RY.txt RZ.txt SA.txt SB.txt SC.txt SD.txt SE.txt SF.txt SG.txt SH.txt SI.txt SJ.txt SK.txt SL.txt SM.txt SN.txt SO.txt SP.txt SQ.txt SR.txt SS.txt ST.txt SU.txt SV.txt SW.txt SX.txt SY.txt SZ.txt TA.txt TB.txt TC.txt TD.txt TE.txt TF.txt TG.txt TH.txt TI.txt TJ.txt TK.txt TL.txt TM.txt TN.txt TO.txt TP.txt TQ.txt TR.txt TS.txt TT.txt TU.txt TV.txt TW.txt TX.txt TY.txt TZ.txt UA.txt UB.txt UC.txt UD.txt UE.txt UF.txt UG.txt UH.txt UI.txt UJ.txt UK.txt UL.txt UM.txt UN.txt UO.txt UP.txt UQ.txt UR.txt US.txt UT.txt UU.txt UV.txt UW.txt UX.txt UY.txt UZ.txt VA.txt VB.txt VC.txt VD.txt VE.txt VF.txt VG.txt VH.txt VI.txt VJ.txt VK.txt VL.txt VM.txt VN.txt VO.txt VP.txt VQ.txt VR.txt VS.txt VT.txt VU.txt VV.txt VW.txt VX.txt VY.txt VZ.txt WA.txt WB.txt WC.txt WD.txt WE.txt WF.txt WG.txt WH.txt WI.txt WJ.txt WK.txt WL.txt WM.txt WN.txt WO.txt WP.txt WQ.txt WR.txt WS.txt WT.txt WU.txt WV.txt WW.txt WX.txt WY.txt WZ.txt XA.txt XB.txt XC.txt XD.txt XE.txt XF.txt XG.txt XH.txt XI.txt XJ.txt XK.txt XL.txt XM.txt XN.txt XO.txt XP.txt XQ.txt XR.txt XS.txt XT.txt XU.txt XV.txt XW.txt XX.txt XY.txt XZ.txt YA.txt YB.txt YC.txt YD.txt YE.txt YF.txt YG.txt YH.txt YI.txt YJ.txt YK.txt YL.txt YM.txt YN.txt YO.txt YP.txt YQ.txt YR.txt YS.txt YT.txt YU.txt YV.txt YW.txt YX.txt YY.txt YZ.txt ZA.txt ZB.txt ZC.txt ZD.txt ZE.txt ZF.txt ZG.txt ZH.txt ZI.txt ZJ.txt ZK.txt ZL.txt ZM.txt ZN.txt ZO.txt ZP.txt ZQ.txt ZR.txt ZS.txt ZT.txt ZU.txt ZV.txt ZW.txt ZX.txt ZY.txt ZZ.txt > allword.txt
@@ -0,0 +1,117 @@
+/* Microbenchmark of side_shell's tokenizer. Times lex_line() against the
+* strtok loop the shells used before, on the longest line of a batch file
+* (the 676 file wordfreq line of word_sorter.bat by default).
+*
+* gcc -O2 -o bench/lex_bench bench/lex_bench.c
+* bench/lex_bench -n 20000 -f word_sorter.bat */
+
+// Pull in the shell itself so the benchmark runs the real lexer
+#define main side_shell_main
+#include "../side_shell.c"
+#undef main
+
+#include <time.h>
+
+// Time since an arbitrary point in nanoseconds
+double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// The old tokenizer: strtok over whitespace, token array grown 64 at a time
+int strtok_split(char *line) {
+    int bufsize = TOKEN_BUFSIZE, position = 0;
+    char **tokens = (char**) malloc(bufsize * sizeof(char*));
+    char *token;
+
+    token = strtok(line, " \t\r\n\a");
+    while (token != NULL) {
+        tokens[position++] = token;
+        if (position >= bufsize) {
+            bufsize += TOKEN_BUFSIZE;
+            tokens = (char**) realloc(tokens, bufsize * sizeof(char*));
+        }
+        token = strtok(NULL, " \t\r\n\a");
+    }
+
+    free(tokens);
+    return position;
+}
+
+// lex_line with its token array allocated once for the line
+int lex_split(char *line) {
+    struct token *tokens = (struct token*) malloc((strlen(line) + 1) * sizeof(struct token));
+    int count = lex_line(line, tokens);
+
+    free(tokens);
+    return count;
+}
+
+// Runs split on a fresh copy of line n times, returns nanoseconds per line
+double run(const char *name, int (*split)(char *), const char *line, int n) {
+    size_t len = strlen(line);
+    char *copy = malloc(len + 1);
+    double start, total = 0;
+    int i, count = 0;
+
+    for (i = 0; i < n; i++) {
+        memcpy(copy, line, len + 1);
+        start = now_ns();
+        count = split(copy);
+        total += now_ns() - start;
+    }
+
+    printf("%-8s %6d tokens %10.0f ns/line %8.1f MB/s\n", name, count, total / n, len * n / total * 1e3);
+    free(copy);
+    return total / n;
+}
+
+int main(int argc, char *argv[]) {
+    char *file = "word_sorter.bat", *line = NULL, *longest = NULL;
+    size_t len = 0;
+    int n = 10000, c;
+    double old_ns, new_ns;
+    FILE *fp;
+
+    while ((c = getopt(argc, argv, "n:f:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n <iterations>] [-f <batch file>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        perror(file);
+        exit(EXIT_FAILURE);
+    }
+    while (getline(&line, &len, fp) != -1) {
+        if (longest == NULL || strlen(line) > strlen(longest)) {
+            free(longest);
+            longest = strdup(line);
+        }
+    }
+    fclose(fp);
+    free(line);
+
+    if (longest == NULL) {
+        fprintf(stderr, "%s is empty\n", file);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("line of %zu bytes, %d iterations\n", strlen(longest), n);
+    old_ns = run("strtok", strtok_split, longest, n);
+    new_ns = run("lex_line", lex_split, longest, n);
+    printf("lex_line speedup: %.2fx\n", old_ns / new_ns);
+
+    free(longest);
+    return 0;
+}
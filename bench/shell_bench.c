@@ -0,0 +1,312 @@
+/* End to end benchmark of the shells themselves. Each workload starts a
+* fresh shell on a pair of pipes, sends it commands one at a time and
+* times every command from writing the line to reading the output of an
+* echo sent right after it. Every sample includes that echo.
+* Reports commands/sec, p50/p99 latency and the peak RSS wait4 gives for
+* the shell once it exits on end of input.
+*
+* Workloads: trivial commands, a deep pipeline, a wide glob, a huge argv
+* line like word_sorter.bat's, and pidloop background jobs. shell.c has no
+* pipes or globbing so it only runs the others. Samples end on the marker
+* rather than a prompt since a finished background job prints its report
+* with a prompt of its own.
+*
+* gcc -O2 -o bench/shell_bench bench/shell_bench.c
+* bench/shell_bench -n 2000 -s ./side_shell -S ./shell -p ./pidloop */
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#define MARKER "shell_bench_mark\n"
+#define MARKER_LINE "echo shell_bench_mark\n"
+#define READ_BUFSIZE 4096
+#define PATH_BUFSIZE 1024
+
+// A shell under test, marks counts the markers read from it so far
+struct shell_proc {
+    pid_t pid;
+    int in_fd;
+    int out_fd;
+    int marks;
+    int matched;
+};
+
+// A generated workload, line is sent count times and setup runs once first
+struct workload {
+    const char *name;
+    char *line;
+    char *setup;
+    char *teardown;
+    int side_only;
+};
+
+// Time since an arbitrary point in microseconds
+double now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Starts the shell with its stdin and stdout on pipes, stderr is dropped
+void start_shell(struct shell_proc *sh, char *path) {
+    int in[2], out[2], null_fd;
+
+    if (pipe(in) < 0 || pipe(out) < 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    sh->pid = fork();
+    if (sh->pid == 0) {
+        null_fd = open("/dev/null", O_WRONLY);
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execl(path, path, (char *) NULL);
+        _exit(127);
+    }
+    if (sh->pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+
+    close(in[0]);
+    close(out[1]);
+    sh->in_fd = in[1];
+    sh->out_fd = out[0];
+    sh->marks = 0;
+    sh->matched = 0;
+}
+
+// Reads output until the shell has printed count markers in all. Returns
+// -1 if the shell went away first
+int wait_marks(struct shell_proc *sh, int count) {
+    char buf[READ_BUFSIZE];
+    ssize_t n, i;
+
+    while (sh->marks < count) {
+        n = read(sh->out_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            if (buf[i] == MARKER[sh->matched]) {
+                if (++sh->matched == (int) strlen(MARKER)) {
+                    sh->marks++;
+                    sh->matched = 0;
+                }
+            } else {
+                sh->matched = buf[i] == MARKER[0];
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Writes all of line to the shell
+int send_line(struct shell_proc *sh, const char *line) {
+    size_t len = strlen(line), done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        if ((n = write(sh->in_fd, line + done, len - done)) < 0) {
+            return -1;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+// Sends one line followed by the marker echo and waits for the marker
+int run_line(struct shell_proc *sh, char *line) {
+    if (send_line(sh, line) < 0 || send_line(sh, MARKER_LINE) < 0) {
+        return -1;
+    }
+
+    return wait_marks(sh, sh->marks + 1);
+}
+
+// Closes the shell's input and returns its peak RSS in KB
+long stop_shell(struct shell_proc *sh) {
+    char buf[READ_BUFSIZE];
+    struct rusage usage;
+    int status;
+
+    close(sh->in_fd);
+    while (read(sh->out_fd, buf, sizeof(buf)) > 0) {
+    }
+    close(sh->out_fd);
+    wait4(sh->pid, &status, 0, &usage);
+
+    return usage.ru_maxrss;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+// Runs a workload count times against a fresh shell and prints its row
+void run_workload(char *shell_path, struct workload *work, int count) {
+    double *samples = malloc(count * sizeof(double)), start, total;
+    struct shell_proc sh;
+    long rss;
+    int i;
+
+    if (!samples) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    start_shell(&sh, shell_path);
+    if (send_line(&sh, MARKER_LINE) < 0 || wait_marks(&sh, 1) < 0 || (work->setup != NULL && run_line(&sh, work->setup) < 0)) {
+        fprintf(stderr, "shell_bench: %s did not start\n", shell_path);
+        exit(EXIT_FAILURE);
+    }
+
+    total = now_us();
+    for (i = 0; i < count; i++) {
+        start = now_us();
+        if (run_line(&sh, work->line) < 0) {
+            fprintf(stderr, "shell_bench: %s exited during %s\n", shell_path, work->name);
+            exit(EXIT_FAILURE);
+        }
+        samples[i] = now_us() - start;
+    }
+    if (work->teardown != NULL) {
+        run_line(&sh, work->teardown);
+    }
+    total = now_us() - total;
+    rss = stop_shell(&sh);
+
+    qsort(samples, count, sizeof(double), compare_doubles);
+    printf("%-14s %-10s %7d %10.0f %9.1f %9.1f %10ld\n", shell_path, work->name, count,
+        count / (total / 1e6), samples[count / 2], samples[(int) (count * 0.99)], rss);
+
+    free(samples);
+}
+
+// Builds a line out of count copies of word joined by sep, numbered makes
+// every copy distinct
+char *repeat(const char *head, const char *word, const char *sep, int count, int numbered) {
+    size_t size = strlen(head) + (size_t) count * (strlen(word) + strlen(sep) + 8) + 2;
+    char *line = malloc(size), *end;
+    int i;
+
+    if (!line) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    end = line + sprintf(line, "%s", head);
+    for (i = 0; i < count; i++) {
+        end += sprintf(end, "%s%s", i > 0 ? sep : "", word);
+        if (numbered) {
+            end += sprintf(end, "%d", i);
+        }
+    }
+    sprintf(end, "\n");
+
+    return line;
+}
+
+int main(int argc, char *argv[]) {
+    char *side_path = "./side_shell", *shell_path = "./shell", *pidloop = "./pidloop";
+    char dir[] = "/tmp/shell_bench.XXXXXX", name[PATH_BUFSIZE];
+    int count = 1000, depth = 16, width = 1000, i, c, fd;
+    char glob_line[PATH_BUFSIZE], bg_line[PATH_BUFSIZE];
+
+    while ((c = getopt(argc, argv, "n:s:S:p:d:w:")) != -1) {
+        switch (c) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 's':
+            side_path = optarg;
+            break;
+        case 'S':
+            shell_path = optarg;
+            break;
+        case 'p':
+            pidloop = optarg;
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'w':
+            width = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n <commands>] [-s <side_shell>] [-S <shell>] [-p <pidloop>] "
+                "[-d <pipeline depth>] [-w <glob width>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (count < 1 || depth < 1 || width < 1) {
+        fprintf(stderr, "shell_bench: counts must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The glob workload matches width empty files in a scratch directory
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < width; i++) {
+        snprintf(name, sizeof(name), "%s/f%06d", dir, i);
+        if ((fd = open(name, O_CREAT | O_WRONLY, 0644)) >= 0) {
+            close(fd);
+        }
+    }
+    snprintf(glob_line, sizeof(glob_line), "true %s/*\n", dir);
+    snprintf(bg_line, sizeof(bg_line), "%s -c 0 -s 0 &\n", pidloop);
+
+    struct workload workloads[] = {
+        { "true", "true\n", NULL, NULL, 0 },
+        { "pipeline", repeat("", "true", " | ", depth, 0), NULL, NULL, 1 },
+        { "glob", glob_line, NULL, NULL, 1 },
+        { "argv", repeat("true ", "w", " ", 676, 1), NULL, NULL, 0 },
+        { "background", bg_line, NULL, "barrier\n", 0 },
+    };
+    int nr_workloads = sizeof(workloads) / sizeof(workloads[0]);
+
+    printf("%-14s %-10s %7s %10s %9s %9s %10s\n", "shell", "workload", "cmds", "cmds/s",
+        "p50 us", "p99 us", "peak KB");
+    for (i = 0; i < nr_workloads; i++) {
+        run_workload(side_path, &workloads[i], count);
+    }
+    for (i = 0; i < nr_workloads; i++) {
+        if (!workloads[i].side_only) {
+            run_workload(shell_path, &workloads[i], count);
+        }
+    }
+
+    for (i = 0; i < width; i++) {
+        snprintf(name, sizeof(name), "%s/f%06d", dir, i);
+        unlink(name);
+    }
+    rmdir(dir);
+
+    return 0;
+}
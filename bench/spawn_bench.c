@@ -0,0 +1,124 @@
+/* Compares the two ways the shells can start a command: fork + execv and
+* posix_spawn. Every launch runs pidloop with no messages and waits for it.
+* Use -m to give the benchmark a large heap, fork gets slower as it grows.
+*
+* gcc -O2 -o bench/spawn_bench bench/spawn_bench.c
+* bench/spawn_bench -n 2000 -m 512 -p ./pidloop */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+// Time since an arbitrary point in microseconds
+double now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Starts the child with fork and execv like the shells used to
+pid_t launch_fork(char **argv, int null_fd) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+// Starts the child with posix_spawn like the shells do now
+pid_t launch_spawn(char **argv, int null_fd) {
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, null_fd, STDOUT_FILENO);
+    if (posix_spawn(&pid, argv[0], &actions, NULL, argv, environ) != 0) {
+        pid = -1;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+
+    return pid;
+}
+
+// Runs count launches one after another and returns microseconds per launch
+double run(const char *name, pid_t (*launch)(char **, int), char **argv, int null_fd, int count) {
+    double start = now_us(), per_launch;
+    int i, status;
+    pid_t pid;
+
+    for (i = 0; i < count; i++) {
+        if ((pid = launch(argv, null_fd)) < 0) {
+            perror(name);
+            exit(EXIT_FAILURE);
+        }
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+            fprintf(stderr, "%s: could not run %s\n", name, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    per_launch = (now_us() - start) / count;
+    printf("%-12s %8d launches %10.1f us/launch\n", name, count, per_launch);
+    return per_launch;
+}
+
+int main(int argc, char *argv[]) {
+    char *child_argv[] = { "./pidloop", "-c", "0", "-s", "0", NULL };
+    int count = 1000, heap_mb = 0, null_fd, c;
+    double fork_us, spawn_us;
+    char *heap;
+
+    while ((c = getopt(argc, argv, "n:m:p:")) != -1) {
+        switch (c) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'm':
+            heap_mb = atoi(optarg);
+            break;
+        case 'p':
+            child_argv[0] = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n <launches>] [-m <heap MB>] [-p <pidloop path>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Touch every page so fork has real page tables to copy
+    if (heap_mb > 0) {
+        heap = malloc((size_t) heap_mb << 20);
+        if (!heap) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        memset(heap, 1, (size_t) heap_mb << 20);
+    }
+
+    if ((null_fd = open("/dev/null", O_WRONLY)) < 0) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("child: %s, heap: %d MB\n", child_argv[0], heap_mb);
+    fork_us = run("fork+exec", launch_fork, child_argv, null_fd, count);
+    spawn_us = run("posix_spawn", launch_spawn, child_argv, null_fd, count);
+    printf("posix_spawn speedup: %.2fx\n", fork_us / spawn_us);
+
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 int main(int argc, char *argv[])
 {
@@ -10,9 +11,12 @@ int main(int argc, char *argv[])
   int count = 5;
   long sleep = 1000; // 1 second. Unit of sleep: millisecond
   int c;
+  int status = 0;
+  int hang = 0;
+  char *flaky = NULL;
  
   pid = getpid();
-  while ((c = getopt(argc, argv, "s:c:")) != -1) {
+  while ((c = getopt(argc, argv, "s:c:e:hf:")) != -1) {
     switch (c) {
     case 's':
       sleep = (long)atoi(optarg);
@@ -21,9 +25,21 @@ int main(int argc, char *argv[])
     case 'c':
       count = atoi(optarg);
       break;
+
+    case 'e':
+      status = atoi(optarg);
+      break;
+
+    case 'h':
+      hang = 1;
+      break;
+
+    case 'f':
+      flaky = optarg;
+      break;
       
     default:
-      fprintf(stderr, "Usage: %s [-s <sleeping time between two messages>] [-c <# messages>]\n", argv[0]);
+      fprintf(stderr, "Usage: %s [-s <sleeping time between two messages>] [-c <# messages>] [-e <exit status>] [-h] [-f <state file>]\n", argv[0]);
       exit(1);
     }
   }
@@ -33,5 +49,23 @@ int main(int argc, char *argv[])
       usleep(sleep * 1000);
   }
 
+  // -h hangs after the messages, for testing timeouts
+  if (hang) {
+    printf("Process %d hanging\n", pid);
+    fflush(stdout);
+    for (;;) {
+      pause();
+    }
+  }
+
+  // -f fails the first run and creates the state file so the next run
+  // succeeds, for testing retries
+  if (flaky != NULL && (c = open(flaky, O_CREAT | O_EXCL | O_WRONLY, 0644)) >= 0) {
+    close(c);
+    printf("Process %d failed\n", pid);
+    exit(1);
+  }
+
   printf("Process %d completed\n", pid);
+  return status;
 }
\ No newline at end of file
@@ -0,0 +1,7 @@
+rm -f pidloop.state
+barrier
+retry 3 backoff=100ms -- ./pidloop -s 10 -c 1 -f pidloop.state
+timeout=300ms -- ./pidloop -s 10 -c 1 -h
+retry 2 backoff=50ms timeout=200ms -- ./pidloop -s 10 -c 1 -h
+retry 1 -- ./pidloop -s 10 -c 1 -e 3
+./pidloop -s 10 -c 1
@@ -8,22 +8,128 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <getopt.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define SH_RL_BUFSIZE 1024
 #define SH_TOK_BUFSIZE 64
-#define SH_TOK_DELIM " \t\r\n\a"
+#define TOKEN_WORD 0
+#define TOKEN_PIPE 1
+#define TOKEN_INPUT 2
+#define TOKEN_OUTPUT 3
+#define TOKEN_APPEND 4
+#define TOKEN_ERROR 5
+#define TOKEN_BACKGROUND 6
+#define SH_PATH_BUFSIZE 1024
+#define SH_CMD_HASHSIZE 256
+#define SH_DEFAULT_PATH "/bin:/usr/bin"
+#define SH_WORD_TABLESIZE 4096
+#define SH_READAHEAD 64
+#define SH_IMAGE_MAGIC "SHBC"
+#define SH_IMAGE_VERSION 2
+// Compiled argv entries at or above this are operators, not string offsets
+#define SH_IMAGE_OPERATOR 0xffffff00u
+
+extern char **environ;
+
+// Operators as they appear on the command line, indexed by token type
+char *OPERATOR_STRING[] = {
+    "",
+    "|",
+    "<",
+    ">",
+    ">>",
+    "2>",
+    "&"
+};
+
+// Files a command's standard streams are redirected to, NULL keeps the
+// shell's own
+struct redirect {
+    char *in;
+    char *out;
+    char *err;
+    int append;
+};
+
+// A word or operator of a command line, start and end are its span in the
+// line as typed, text is the word after quotes and escapes are removed
+struct token {
+    char *text;
+    int type;
+    int quoted;
+    int start;
+    int end;
+};
+
+// Type of an argument split_line returned, TOKEN_WORD unless it is one
+// of the operator strings themselves
+int token_type(const char *arg) {
+    int type;
+
+    for (type = TOKEN_PIPE; type <= TOKEN_BACKGROUND; type++) {
+        if (arg == OPERATOR_STRING[type]) {
+            return type;
+        }
+    }
+    return TOKEN_WORD;
+}
 
 // Shell pid, gpid 
 static pid_t SH_PID;
 static pid_t SH_PGID;
 pid_t pid;
 
-struct sigaction act_child;
 struct sigaction act_int;
 
+// SIGCHLD arrives through a signalfd that the prompt's event loop watches
+int sigchld_fd;
+int epoll_fd;
+
+// Input read from stdin in blocks, a block may run past the current line
+char input_buf[SH_RL_BUFSIZE * 4];
+size_t input_pos;
+size_t input_len;
+
 // Global flags
 int no_prompt;
 int background;
+// Set while a batch line runs under its retry and timeout policy, the
+// child is then waited for by the batch event loop
+int supervised;
+// Wait status of the last child batch mode waited for, -1 if there is none
+int last_status;
+
+// Cached absolute path of a command found in $PATH
+struct command_path {
+    char *name;
+    char *path;
+    int hits;
+    struct command_path *next;
+};
+
+struct command_path *command_table[SH_CMD_HASHSIZE];
+char *hashed_path;
+
+// Path of the last command found through a relative $PATH entry
+char relative_command[SH_PATH_BUFSIZE];
+
+// Batch mode worker pool, max_jobs > 1 lets children run in parallel
+int max_jobs;
+int running_jobs;
 
 /*
  * Function Declarations for builtin shell commands
@@ -31,12 +137,9 @@ int background;
 int shell_cd(char **args);
 int shell_help(char **args);
 int shell_quit(char **args);
-
-// handler for SIGCHILD
-void signalHandler_child(int p) {
-    while (waitpid(-1, NULL, WNOHANG) > 0) {
-    }
-}
+int shell_barrier(char **args);
+int shell_hash(char **args);
+int shell_wordfreq(char **args);
 
 // handler for SIGINT
 void signalHandler_int(int p) {
@@ -55,12 +158,18 @@ char *builtin_str[] = {
     "cd",
     "help",
     "quit",
+    "barrier",
+    "hash",
+    "wordfreq",
 };
 
 int (*builtin_func[]) (char **) = {
     &shell_cd,
     &shell_help,
     &shell_quit,
+    &shell_barrier,
+    &shell_hash,
+    &shell_wordfreq,
 };
 
 int shell_num_builtins() {
@@ -106,283 +215,2461 @@ int shell_quit(char **args) {
     return 0;
 }
 
-// Function that returns the extension of a file so we can check if file is a batch file
-const char *get_filename_ext(const char *file_name) {
-    const char *dot = strrchr(file_name, '.');
-    if (!dot || dot == file_name) return "";
-    return dot + 1; 
+// Waits for one batch child to finish and frees up its slot in the pool
+void reap_job(void) {
+    if (wait(NULL) > 0) {
+        running_jobs--;
+    } else if (errno == ECHILD) {
+        running_jobs = 0;
+    }
 }
 
-// Check to see if & is at the end of final token but not alone in the token
-// Returns 1 when we find the background flag
-int check_background(char **args) {
-    int arg_num = 0;  
-    char *last_token;
-   
-    // get the number of arguments
-    while (args[arg_num] != NULL) { 
-        arg_num++;
-    } 
-    
-    // Compare & with last character of last token then handle accordingly
-    last_token = args[arg_num-1]; 
-    if (last_token[strlen(last_token)-1] == '&') {
-        last_token[strlen(last_token)-1] = '\0';
-        return 1;
+// Waits for every running child, used where the batch file has to serialize
+int shell_barrier(char **args) {
+    (void) args;
+
+    if (max_jobs > 1) {
+        while (running_jobs > 0) {
+            reap_job();
+        }
     } else {
-        return 0;
+        while (wait(NULL) > 0 || errno == EINTR) {
+        }
     }
+
+    return 1;
 }
 
-// Reads in line from shell so we can parse it
-char *read_line(void) {
-    int buff_size = SH_RL_BUFSIZE;
-    int position = 0;
-    char *buffer = malloc(sizeof(char) *buff_size);
-    int c;
+// Blocks until the pool has room for another child
+void reserve_slot(void) {
+    while (max_jobs > 1 && running_jobs >= max_jobs) {
+        reap_job();
+    }
+}
 
-    if(!buffer) {
-        fprintf(stderr, "shell: allocation error\n");
-        exit(EXIT_FAILURE);
+// In parallel batch mode the child is only counted, otherwise we wait for it
+void wait_child(pid_t child, int *status) {
+    if (max_jobs > 1) {
+        running_jobs++;
+    } else if (!supervised) {
+        waitpid(child, &last_status, WUNTRACED);
+        if (status != NULL) {
+            *status = last_status;
+        }
     }
+}
 
-    // Read a character
-    while (1) {
-        c = getchar();
+// Reaps background children that have finished, report prints them like a job list
+// Returns the number of children reaped
+int reap_background(int report) {
+    struct signalfd_siginfo info;
+    pid_t child;
+    int count = 0;
 
-        // IF EOF replace with a null char and return
-        if (c == EOF || c == '\n') {
-            buffer[position] = '\0';
-            return buffer;
-        } else {
-            buffer[position] = c;
+    while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+
+    while ((child = waitpid(-1, NULL, WNOHANG)) > 0) {
+        if (report) {
+            printf("[%d] done\n", child);
         }
-        position++;
+        count++;
+    }
 
-        // If we have exceeded the buffer, reallocate
-        if (position >= buff_size) {
-            buff_size += SH_RL_BUFSIZE;
-            buffer = realloc(buffer, buff_size);
+    return count;
+}
 
-            if (!buffer) {
-                fprintf(stderr, "shell: allocate error\n");
-                exit(EXIT_FAILURE);
+// Waits for the next line of input while reaping children as they exit
+void wait_for_input(void) {
+    struct epoll_event event;
+
+    // A line already read ahead is ready without asking epoll
+    if (input_pos < input_len) {
+        return;
+    }
+
+    if (epoll_fd < 0) {
+        reap_background(1);
+        return;
+    }
+
+    while (1) {
+        // Ctrl-C interrupts the wait, event holds nothing then
+        if (epoll_wait(epoll_fd, &event, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            return;
+        }
+        if (event.data.fd != sigchld_fd) {
+            return;
+        }
+        if (reap_background(1) > 0) {
+            printf("prompt> ");
+            fflush(stdout);
         }
     }
 }
 
-// Parses line into tokens. Prob could give it more descriptive name
-char **split_line(char (*line)) {
-    int buff_size = SH_TOK_BUFSIZE, position = 0;
-    char **tokens = malloc(buff_size * sizeof(char *));
-    char *token;
-    
+// Bucket of a command name in the command table
+int command_hash(char *name) {
+    unsigned int hash = 5381;
 
-    if (!tokens) {
-        fprintf(stderr, "shell: allocation error\n");
-        exit(EXIT_FAILURE);
+    while (*name != '\0') {
+        hash = hash * 33 + (unsigned char) *name++;
+    }
+
+    return hash % SH_CMD_HASHSIZE;
+}
+
+// Forgets every cached command path
+void clear_command_table(void) {
+    int i;
+    struct command_path *entry, *next;
+
+    for (i = 0; i < SH_CMD_HASHSIZE; i++) {
+        for (entry = command_table[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+        command_table[i] = NULL;
+    }
+}
+
+// Drops one command from the cache, used when its cached path stops working
+void forget_command(char *name) {
+    struct command_path **link = &command_table[command_hash(name)], *entry;
+
+    for (; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) {
+            entry = *link;
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+    }
+}
+
+// Resolves a command to an absolute path, walking $PATH only on a cache miss.
+// The cache is thrown away whenever $PATH differs from the one it was filled from
+char *lookup_command(char *name) {
+    char *path = getenv("PATH"), *dir, *end;
+    char candidate[SH_PATH_BUFSIZE];
+    struct command_path *entry;
+    struct stat st;
+    int bucket, dir_len;
+
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    if (path == NULL) {
+        path = SH_DEFAULT_PATH;
+    }
+    if (hashed_path == NULL || strcmp(hashed_path, path) != 0) {
+        clear_command_table();
+        free(hashed_path);
+        hashed_path = strdup(path);
+        if (!hashed_path) {
+            fprintf(stderr, "shell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    bucket = command_hash(name);
+    for (entry = command_table[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            return entry->path;
+        }
     }
 
-    token = strtok(line, SH_TOK_DELIM);
-    while (token != NULL) {
-        tokens[position] = token; 
-        position++;
+    for (dir = path; ; dir = end + 1) {
+        end = strchr(dir, ':');
+        dir_len = end != NULL ? end - dir : (int) strlen(dir);
 
-        if (position >= buff_size) {
-            buff_size += SH_TOK_BUFSIZE;
-            tokens = realloc(tokens, buff_size * sizeof(char *));
+        // An empty entry in $PATH means the current directory
+        if (dir_len == 0) {
+            snprintf(candidate, sizeof(candidate), "./%s", name);
+        } else {
+            snprintf(candidate, sizeof(candidate), "%.*s/%s", dir_len, dir, name);
+        }
 
-            if (!tokens) {
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            // A relative entry depends on the current directory, so it
+            // is not cached and is only good until the next lookup
+            if (candidate[0] != '/') {
+                memcpy(relative_command, candidate, sizeof(candidate));
+                return relative_command;
+            }
+            entry = malloc(sizeof(struct command_path));
+            if (!entry) {
                 fprintf(stderr, "shell: allocation error\n");
                 exit(EXIT_FAILURE);
             }
+            entry->name = strdup(name);
+            entry->path = strdup(candidate);
+            if (!entry->name || !entry->path) {
+                fprintf(stderr, "shell: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            entry->hits = 1;
+            entry->next = command_table[bucket];
+            command_table[bucket] = entry;
+            return entry->path;
+        }
+
+        if (end == NULL) {
+            return NULL;
         }
+    }
+}
+
+// Lists the cached commands, -r empties the cache and names are looked up
+int shell_hash(char **args) {
+    int i;
+    struct command_path *entry;
 
-        token = strtok(NULL, SH_TOK_DELIM);
+    if (args[1] == NULL) {
+        printf("hits\tcommand\n");
+        for (i = 0; i < SH_CMD_HASHSIZE; i++) {
+            for (entry = command_table[i]; entry != NULL; entry = entry->next) {
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+        return 1;
     }
 
-    tokens[position] = NULL; 
+    for (i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-r") == 0) {
+            clear_command_table();
+        } else if (lookup_command(args[i]) == NULL) {
+            fprintf(stderr, "shell: hash: %s: not found\n", args[i]);
+        }
+    }
 
-    return tokens;
+    return 1;
 }
 
-void redirection(char *args[], char *in_file, char *out_file) {
-    int fd;
-    char *args_copy[256]; 
+// Word count of one distinct word, the text stays in the mapped file
+struct word_entry {
+    uint64_t hash;
+    const char *word;
+    uint32_t len;
+    uint32_t count;
+};
 
-    int j = 0;
-    while (args[j] != NULL) {
-        if (strcmp(args[j], ">") == 0 || (strcmp(args[j], "&")) == 0) {
-            break;
-        }   
+// Open addressing table of words, one per worker thread
+struct word_table {
+    struct word_entry *entries;
+    size_t size;
+    size_t used;
+};
 
-        args_copy[j] = args[j];
-        j++;
+// A mapped input file, table entries point into it until the run ends
+struct file_map {
+    char *text;
+    size_t size;
+};
+
+// Shared state of a wordfreq run, workers take files by index
+struct wordfreq_job {
+    char **files;
+    struct file_map *maps;
+    int nr_files;
+    int next_file;
+    pthread_mutex_t lock;
+    struct word_table *tables;
+};
+
+// FNV-1a hash of a word
+uint64_t word_hash(const char *word, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) word[i]) * 1099511628211ULL;
     }
 
-    pid = fork();
-    if (pid == 0) {
-        // Child Process
-       
-        // Open corresponding file and truncate its length to 0
-        fd = open(out_file, O_CREAT | O_TRUNC | O_WRONLY, 0600);
-        if (fd < 0) {
-            fprintf(stderr, "Could not open the file: %s\n", out_file);
-            exit(EXIT_FAILURE);
-        }
+    return hash;
+}
 
-        // Redirect command line output into file
-        dup2(fd, STDOUT_FILENO);
-        close(fd); 
+void word_table_init(struct word_table *table, size_t size) {
+    table->entries = calloc(size, sizeof(struct word_entry));
+    table->size = size;
+    table->used = 0;
 
-        // Run the corresponding command
-        if (execvp(args[0], args_copy) == -1) { 
-            fprintf(stderr, "Could not run the command: %s\n", args[0]);
-            kill(getpid(), SIGTERM);
+    if (!table->entries) {
+        fprintf(stderr, "shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void word_table_add(struct word_table *table, uint64_t hash, const char *word, uint32_t len, uint32_t count);
+
+// Doubles the table once it is half full so probe chains stay short
+void word_table_grow(struct word_table *table) {
+    struct word_table bigger;
+    size_t i;
+
+    word_table_init(&bigger, table->size * 2);
+    for (i = 0; i < table->size; i++) {
+        if (table->entries[i].word != NULL) {
+            word_table_add(&bigger, table->entries[i].hash, table->entries[i].word,
+                table->entries[i].len, table->entries[i].count);
         }
+    }
 
-    } else if (pid < 0) { 
-        // Error forking
-        fprintf(stderr, "Error forking the child process\n");
-        exit(EXIT_FAILURE);
+    free(table->entries);
+    *table = bigger;
+}
+
+// Adds count occurrences of a word, probing linearly from its hash
+void word_table_add(struct word_table *table, uint64_t hash, const char *word, uint32_t len, uint32_t count) {
+    size_t mask = table->size - 1, i = hash & mask;
+    struct word_entry *entry;
+
+    for (;; i = (i + 1) & mask) {
+        entry = &table->entries[i];
+        if (entry->word == NULL) {
+            break;
+        }
+        if (entry->hash == hash && entry->len == len && memcmp(entry->word, word, len) == 0) {
+            entry->count += count;
+            return;
+        }
     }
 
-    waitpid(pid, NULL, 0);
+    entry->hash = hash;
+    entry->word = word;
+    entry->len = len;
+    entry->count = count;
+
+    if (++table->used * 2 > table->size) {
+        word_table_grow(table);
+    }
 }
 
-// Creates child processes to execute non builtin commands
-int launch_shell(char **args) { 
-    int status;
-    
-    if (!background) {
-        background = check_background(args); 
-    } 
+// Marks which of 16 bytes are ASCII letters, one bit per byte
+static inline unsigned int alpha_mask(const char *text) {
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128((const __m128i *) text);
+    __m128i offset = _mm_sub_epi8(_mm_or_si128(bytes, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(offset, _mm_set1_epi8(25)), _mm_set1_epi8(25)));
+#else
+    unsigned int mask = 0;
+    int i;
 
-    pid = fork();
+    for (i = 0; i < 16; i++) {
+        if ((unsigned char) ((text[i] | 0x20) - 'a') < 26) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+}
 
-    if (pid == 0) {
-        // Child process   
-           
-        // Execute not builtin function
-        if (execvp(args[0], args) == -1) {
-            fprintf(stderr, "Could not execute the %s command\n", args[0]); 
+// Counts every run of letters in the text, same words grep -o "[a-zA-Z]*" prints.
+// Works on 16 bytes at a time and only looks at the bytes where a run starts or ends
+void count_words(struct word_table *table, const char *text, size_t size) {
+    const char *start = NULL;
+    unsigned int mask, edges;
+    size_t pos, i;
+    int bit;
+
+    for (pos = 0; pos + 16 <= size; pos += 16) {
+        mask = alpha_mask(text + pos);
+
+        // Bits where a letter follows a non letter or the other way round
+        edges = mask ^ ((mask << 1) | (start != NULL));
+        edges &= 0xFFFF;
+        while (edges != 0) {
+            bit = __builtin_ctz(edges);
+            edges &= edges - 1;
+            if (start == NULL) {
+                start = text + pos + bit;
+            } else {
+                word_table_add(table, word_hash(start, text + pos + bit - start), start, text + pos + bit - start, 1);
+                start = NULL;
+            }
         }
+    }
 
-        exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        // Error forking
-        fprintf(stderr, "Unable to fork the child process for command %s\n", args[0]); 
-        exit(EXIT_FAILURE);
-    } 
-    
-    // if background flag not set we wait for process to finish
-    if (!background) {
-        waitpid(pid, &status, WUNTRACED);
+    for (i = pos; i < size; i++) {
+        int is_alpha = (unsigned char) ((text[i] | 0x20) - 'a') < 26;
+        if (is_alpha && start == NULL) {
+            start = text + i;
+        } else if (!is_alpha && start != NULL) {
+            word_table_add(table, word_hash(start, text + i - start), start, text + i - start, 1);
+            start = NULL;
+        }
     }
 
-    return 1;
+    if (start != NULL) {
+        word_table_add(table, word_hash(start, text + size - start), start, text + size - start, 1);
+    }
 }
 
-// Executes builtin functions or returns non builtin function calls
-// Need to add redirection functionality
-int shell_execute(char **args) {
-    int i = 0;
-    //int j = 0; 
+// Worker thread, maps the next unclaimed file and counts it into its own table
+void *wordfreq_worker(void *arg) {
+    struct wordfreq_job *job = ((void **) arg)[0];
+    struct word_table *table = ((void **) arg)[1];
+    struct stat st;
+    char *text;
+    int file, fd;
 
-    char *args_copy[256];
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        file = job->next_file++;
+        pthread_mutex_unlock(&job->lock);
 
-    if (args[0] == NULL) {
-        // Empty command was entered
-        return 1;
+        if (file >= job->nr_files) {
+            return NULL;
+        }
+
+        if ((fd = open(job->files[file], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+            fprintf(stderr, "wordfreq: %s: unable to open\n", job->files[file]);
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+
+        if (st.st_size > 0) {
+            text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (text != MAP_FAILED) {
+                posix_madvise(text, st.st_size, POSIX_MADV_SEQUENTIAL);
+                count_words(table, text, st.st_size);
+                job->maps[file].text = text;
+                job->maps[file].size = st.st_size;
+            }
+        }
+        close(fd);
     }
+}
 
-    // quit end shell 
-    if (strcmp(args[0], "quit") == 0) return shell_quit(args);
-    // help returns list of builtin functions
-    else if (strcmp(args[0], "help") == 0) return shell_help(args);
-    // cd changes the directory
-    else if (strcmp(args[0], "cd") == 0) return shell_cd(args);     
-    // args[0] is not a builtin function
-    else {
-        while (args[i] != NULL && background == 0) {
-            if (strcmp(args[i], "&") == 0) {
-                // Change background flag
-                // & should be last thing in command line end loop
-                background = 1;
-                args[i] = NULL;
-            } else if (strcmp(args[i], ">") == 0) {
-                if (args[i+1] == NULL) {
-                    printf("No pathname\n");
-                    return -1;
-                } 
-                redirection(args, NULL, args[i+1]);
+// Most frequent first, ties in byte order
+int compare_words(const void *a, const void *b) {
+    const struct word_entry *x = a, *y = b;
+    int cmp;
+
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    cmp = memcmp(x->word, y->word, x->len < y->len ? x->len : y->len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (int) x->len - (int) y->len;
+}
+
+// wordfreq [-k top] [-t threads] files... [> output]
+// Counts the words of the files and prints "count word" lines, most frequent first
+int shell_wordfreq(char **args) {
+    struct wordfreq_job job;
+    struct word_table *merged;
+    pthread_t *threads;
+    char *started;
+    void **thread_args;
+    FILE *out = stdout;
+    long top = 0, nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t i, count = 0;
+    int t;
+
+    job.files = malloc(sizeof(char *) * (SH_TOK_BUFSIZE + 1));
+    job.nr_files = 0;
+    job.next_file = 0;
+    for (i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-k") == 0 && args[i+1] != NULL) {
+            top = atol(args[++i]);
+        } else if (strcmp(args[i], "-t") == 0 && args[i+1] != NULL) {
+            nr_threads = atol(args[++i]);
+        } else if (token_type(args[i]) == TOKEN_OUTPUT && args[i+1] != NULL) {
+            if (out != stdout) {
+                fclose(out);
+            }
+            if ((out = fopen(args[++i], "w")) == NULL) {
+                fprintf(stderr, "Could not open the file: %s\n", args[i]);
+                free(job.files);
                 return 1;
             }
-            i++;
+        } else {
+            if (job.nr_files % SH_TOK_BUFSIZE == 0) {
+                job.files = realloc(job.files, sizeof(char *) * (job.nr_files + SH_TOK_BUFSIZE + 1));
+                if (!job.files) {
+                    fprintf(stderr, "shell: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            job.files[job.nr_files++] = args[i];
         }
-    } 
+    }
 
-    // Prob should change this to args_copy[i]
-    return launch_shell(args);
-}
+    job.maps = calloc(job.nr_files + 1, sizeof(struct file_map));
+    if (!job.maps) {
+        fprintf(stderr, "shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
 
-// Interactive Mode's main loop
-void interactive_mode(void) {
-    char *line;
-    char **args;
-    int status;
+    if (nr_threads < 1) {
+        nr_threads = 1;
+    }
+    if (nr_threads > job.nr_files && job.nr_files > 0) {
+        nr_threads = job.nr_files;
+    }
 
-    do {
-        printf("prompt> ");
-        line = read_line();
-        args = split_line(line); 
-        status = shell_execute(args);
+    pthread_mutex_init(&job.lock, NULL);
+    job.tables = malloc(nr_threads * sizeof(struct word_table));
+    threads = malloc(nr_threads * sizeof(pthread_t));
+    thread_args = malloc(nr_threads * 2 * sizeof(void *));
+    started = malloc(nr_threads);
+    if (!job.tables || !threads || !thread_args || !started) {
+        fprintf(stderr, "shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
 
-        free(line);
-        free (args);
-        background = 0;
-    } while (status);
-}
+    for (t = 0; t < nr_threads; t++) {
+        word_table_init(&job.tables[t], SH_WORD_TABLESIZE);
+        thread_args[2 * t] = &job;
+        thread_args[2 * t + 1] = &job.tables[t];
+        // Without a thread the shard is counted here, taking whatever
+        // files are still unclaimed
+        started[t] = pthread_create(&threads[t], NULL, wordfreq_worker, &thread_args[2 * t]) == 0;
+        if (!started[t]) {
+            wordfreq_worker(&thread_args[2 * t]);
+        }
+    }
 
-void batch_mode(char* batch_file_name) {
-    FILE *fp;
-    char *line = NULL;
-    char **args;
-    size_t len = 0;
-    ssize_t read;
+    // Fold every shard into the first one
+    merged = &job.tables[0];
+    if (started[0]) {
+        pthread_join(threads[0], NULL);
+    }
+    for (t = 1; t < nr_threads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+        for (i = 0; i < job.tables[t].size; i++) {
+            struct word_entry *entry = &job.tables[t].entries[i];
+            if (entry->word != NULL) {
+                word_table_add(merged, entry->hash, entry->word, entry->len, entry->count);
+            }
+        }
+        free(job.tables[t].entries);
+    }
 
-    if ((fp = fopen(batch_file_name, "r")) == NULL) {
-        fprintf(stderr, "Unable to open the batch file: %s\n", batch_file_name);
-        exit(EXIT_FAILURE); 
+    // Pack the entries to the front and sort them
+    for (i = 0; i < merged->size; i++) {
+        if (merged->entries[i].word != NULL) {
+            merged->entries[count++] = merged->entries[i];
+        }
     }
+    qsort(merged->entries, count, sizeof(struct word_entry), compare_words);
 
-    while ((read = getline(&line, &len, fp)) != -1) {
-        printf("%s", line); 
-        args = split_line(line);
-        shell_execute(args);
+    if (top > 0 && (size_t) top < count) {
+        count = top;
+    }
+    for (i = 0; i < count; i++) {
+        fprintf(out, "%u %.*s\n", merged->entries[i].count, (int) merged->entries[i].len, merged->entries[i].word);
     }
 
-    fclose(fp);
-    if (line) free(line);
-    if (args) free(args);
+    if (out != stdout) {
+        fclose(out);
+    } else {
+        fflush(stdout);
+    }
 
-    exit(EXIT_SUCCESS);
+    for (t = 0; t < job.nr_files; t++) {
+        if (job.maps[t].text != NULL) {
+            munmap(job.maps[t].text, job.maps[t].size);
+        }
+    }
+
+    free(job.maps);
+    free(merged->entries);
+    free(job.tables);
+    free(threads);
+    free(started);
+    free(thread_args);
+    free(job.files);
+    pthread_mutex_destroy(&job.lock);
+
+    return 1;
 }
 
-int main (int argc, char *argv[]) {  
-    no_prompt = 0;
-    background = 0;
+// Starts a command with posix_spawn, which glibc runs through
+// clone(CLONE_VM|CLONE_VFORK) so the shell's memory is never copied.
+// The child gets SIGCHLD unblocked and the files of redir, if any, as its
+// standard streams. Returns 0 and sets pid when the command started
+int spawn_command(char **args, struct redirect *redir) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t mask;
+    pid_t child;
+    char *path;
+    int error;
+
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setsigmask(&attr, &mask);
+
+    posix_spawn_file_actions_init(&actions);
+    if (redir->in != NULL) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, redir->in, O_RDONLY, 0);
+    }
+    if (redir->out != NULL) {
+        // Open corresponding file and truncate its length to 0 unless >>
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, redir->out,
+            O_CREAT | O_WRONLY | (redir->append ? O_APPEND : O_TRUNC), 0600);
+    }
+    if (redir->err != NULL) {
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, redir->err,
+            O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    }
 
-    pid = -10; // pid not possible
+    // A cached path that has gone away is forgotten and looked up again
+    error = ENOENT;
+    if ((path = lookup_command(args[0])) != NULL) {
+        error = posix_spawn(&child, path, &actions, &attr, args, environ);
+        if (error == ENOENT && path != args[0]) {
+            forget_command(args[0]);
+            if ((path = lookup_command(args[0])) != NULL) {
+                error = posix_spawn(&child, path, &actions, &attr, args, environ);
+            }
+        }
+    }
+    if (error == 0) {
+        pid = child;
+    }
 
-    SH_PID = getpid();
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
 
-    act_child.sa_handler = signalHandler_child;
-    act_int.sa_handler = signalHandler_int;
+    return error;
+}
 
-    sigaction(SIGCHLD, &act_child, 0);
-    sigaction(SIGINT, &act_int, 0);
+// Function that returns the extension of a file so we can check if file is a batch file
+const char *get_filename_ext(const char *file_name) {
+    const char *dot = strrchr(file_name, '.');
+    if (!dot || dot == file_name) return "";
+    return dot + 1; 
+}
+
+// Reads in line from shell so we can parse it
+char *read_line(void) {
+    size_t buff_size = SH_RL_BUFSIZE;
+    size_t position = 0, len;
+    char *buffer = malloc(sizeof(char) *buff_size);
+    char *start, *end;
+    ssize_t count;
+
+    if(!buffer) {
+        fprintf(stderr, "shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        // Read whatever is waiting in one go instead of a byte at a time
+        if (input_pos == input_len) {
+            count = read(STDIN_FILENO, input_buf, sizeof(input_buf));
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                // Nothing left to read, leave like quit would
+                if (position == 0) {
+                    printf("\n");
+                    exit(EXIT_SUCCESS);
+                }
+                buffer[position] = '\0';
+                return buffer;
+            }
+            input_pos = 0;
+            input_len = count;
+        }
+
+        start = input_buf + input_pos;
+        end = memchr(start, '\n', input_len - input_pos);
+        len = end != NULL ? (size_t) (end - start) : input_len - input_pos;
+
+        // Double the buffer so long pasted lines take few reallocations
+        if (position + len + 1 > buff_size) {
+            while (position + len + 1 > buff_size) {
+                buff_size *= 2;
+            }
+            buffer = realloc(buffer, buff_size);
+
+            if (!buffer) {
+                fprintf(stderr, "shell: allocate error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        memcpy(buffer + position, start, len);
+        position += len;
+        input_pos += len + (end != NULL);
+
+        if (end != NULL) {
+            buffer[position] = '\0';
+            return buffer;
+        }
+    }
+}
+// Splits a line into words and operators in a single pass. Quotes and
+// backslashes are removed while the words are written back into the line
+// itself, so no word is copied anywhere else. Operator tokens point at
+// static strings. tokens needs room for strlen(line) + 1 entries.
+// Returns the number of tokens, or -1 for an unterminated quote
+int lex_line(char *line, struct token *tokens) {
+    char *r = line, *w, delim;
+    int count = 0, quoted;
+
+    while (1) {
+        while (*r == ' ' || *r == '\t' || *r == '\r' || *r == '\n' || *r == '\a') {
+            r++;
+        }
+        if (*r == '\0') {
+            return count;
+        }
+
+        tokens[count].start = r - line;
+        tokens[count].quoted = 0;
+
+        // 2> only counts as an operator at the start of a token
+        if (r[0] == '2' && r[1] == '>') {
+            tokens[count].type = TOKEN_ERROR;
+            tokens[count].text = OPERATOR_STRING[TOKEN_ERROR];
+            r += 2;
+            tokens[count++].end = r - line;
+            continue;
+        }
+        if (*r == '|' || *r == '<' || *r == '>' || *r == '&') {
+            delim = *r;
+        } else {
+            // Copy the word onto itself, dropping quotes and escapes
+            w = r;
+            quoted = 0;
+            tokens[count].text = w;
+            tokens[count].type = TOKEN_WORD;
+            while (*r != '\0' && *r != ' ' && *r != '\t' && *r != '\r' && *r != '\n' && *r != '\a' &&
+                   *r != '|' && *r != '<' && *r != '>' && *r != '&') {
+                if (*r == '\'') {
+                    quoted = 1;
+                    for (r++; *r != '\'' && *r != '\0'; ) {
+                        *w++ = *r++;
+                    }
+                    if (*r++ == '\0') {
+                        return -1;
+                    }
+                } else if (*r == '"') {
+                    quoted = 1;
+                    for (r++; *r != '"' && *r != '\0'; ) {
+                        if (*r == '\\' && (r[1] == '"' || r[1] == '\\' || r[1] == '$' || r[1] == '`')) {
+                            r++;
+                        }
+                        *w++ = *r++;
+                    }
+                    if (*r++ == '\0') {
+                        return -1;
+                    }
+                } else if (*r == '\\' && r[1] != '\0') {
+                    quoted = 1;
+                    r++;
+                    *w++ = *r++;
+                } else {
+                    *w++ = *r++;
+                }
+            }
+
+            // Terminating the word may overwrite the operator after it
+            delim = *r;
+            tokens[count].end = r - line;
+            tokens[count++].quoted = quoted;
+            *w = '\0';
+            if (delim != '|' && delim != '<' && delim != '>' && delim != '&') {
+                if (delim != '\0') {
+                    r++;
+                }
+                continue;
+            }
+            tokens[count].start = r - line;
+            tokens[count].quoted = 0;
+        }
+
+        if (delim == '>' && r[1] == '>') {
+            tokens[count].type = TOKEN_APPEND;
+            r += 2;
+        } else {
+            tokens[count].type = delim == '|' ? TOKEN_PIPE :
+                                 delim == '<' ? TOKEN_INPUT :
+                                 delim == '>' ? TOKEN_OUTPUT : TOKEN_BACKGROUND;
+            r++;
+        }
+        tokens[count].text = OPERATOR_STRING[tokens[count].type];
+        tokens[count++].end = r - line;
+    }
+}
+
+// Parses line into tokens. Prob could give it more descriptive name
+// Operators come back as their own tokens, quotes are already removed.
+// An operator is returned as its OPERATOR_STRING entry itself, so
+// token_type can tell it from a quoted word that reads the same
+char **split_line(char (*line)) {
+    // Tokens only live until the words are copied out, so each thread
+    // keeps one buffer and grows it for longer lines
+    static _Thread_local struct token *tokens;
+    static _Thread_local size_t tokens_size;
+    size_t len = strlen(line);
+    char **args = malloc((len + 1) * sizeof(char *));
+    int count, i;
+
+    if (len + 1 > tokens_size) {
+        free(tokens);
+        tokens_size = len + 1 > SH_TOK_BUFSIZE ? (len + 1) * 2 : SH_TOK_BUFSIZE;
+        tokens = malloc(tokens_size * sizeof(struct token));
+    }
+    if (!tokens || !args) {
+        fprintf(stderr, "shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    count = lex_line(line, tokens);
+    if (count < 0) {
+        fprintf(stderr, "shell: unexpected end of line while looking for a matching quote\n");
+        count = 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        args[i] = tokens[i].text;
+    }
+    args[count] = NULL;
+
+    return args;
+}
+
+// Builds the argument vector of the command in args, leaving out the
+// operators, and puts the files they name in redir. & sets the background
+// flag and ends the command. Returns NULL after printing an error for a
+// pipe or an operator without a file
+char **parse_command(char **args, struct redirect *redir) {
+    char **argv;
+    int i, count = 0, type;
+
+    for (i = 0; args[i] != NULL; i++) {
+    }
+    argv = malloc((i + 1) * sizeof(char *));
+    if (!argv) {
+        fprintf(stderr, "shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(redir, 0, sizeof(struct redirect));
+
+    for (i = 0; args[i] != NULL; i++) {
+        type = token_type(args[i]);
+        if (type == TOKEN_WORD) {
+            argv[count++] = args[i];
+            continue;
+        }
+        if (type == TOKEN_BACKGROUND) {
+            background = 1;
+            break;
+        }
+        if (type == TOKEN_PIPE) {
+            fprintf(stderr, "shell: pipes are not supported\n");
+            free(argv);
+            return NULL;
+        }
+        if (args[i + 1] == NULL || token_type(args[i + 1]) != TOKEN_WORD) {
+            fprintf(stderr, "shell: syntax error near unexpected token `%s'\n",
+                args[i + 1] != NULL ? args[i + 1] : "newline");
+            free(argv);
+            return NULL;
+        }
+        i++;
+        if (type == TOKEN_INPUT) {
+            redir->in = args[i];
+        } else if (type == TOKEN_ERROR) {
+            redir->err = args[i];
+        } else {
+            redir->out = args[i];
+            redir->append = type == TOKEN_APPEND;
+        }
+    }
+    argv[count] = NULL;
+
+    return argv;
+}
+
+// Creates child processes to execute non builtin commands
+int launch_shell(char **args, struct redirect *redir) { 
+    int status;
+
+    reserve_slot();
+    if (spawn_command(args, redir) != 0) {
+        fprintf(stderr, "Could not execute the %s command\n", args[0]); 
+        return 1;
+    }
+    
+    // if background flag not set we wait for process to finish
+    if (!background) {
+        wait_child(pid, &status);
+    } else if (max_jobs > 1) {
+        running_jobs++;
+    }
+
+    return 1;
+}
+
+// Executes builtin functions or returns non builtin function calls
+int shell_execute(char **args) {
+    struct redirect redir;
+    char **argv;
+
+    if (args[0] == NULL) {
+        // Empty command was entered
+        return 1;
+    }
+
+    // quit end shell 
+    if (strcmp(args[0], "quit") == 0) return shell_quit(args);
+    // help returns list of builtin functions
+    else if (strcmp(args[0], "help") == 0) return shell_help(args);
+    // cd changes the directory
+    else if (strcmp(args[0], "cd") == 0) return shell_cd(args);     
+    // barrier waits for every child started so far
+    else if (strcmp(args[0], "barrier") == 0) return shell_barrier(args);
+    // hash shows or changes the command path cache
+    else if (strcmp(args[0], "hash") == 0) return shell_hash(args);
+    // wordfreq ranks the words of its files by count
+    else if (strcmp(args[0], "wordfreq") == 0) return shell_wordfreq(args);
+
+    // args[0] is not a builtin function. The operators are taken out of a
+    // copy since batch retries run the same args again
+    if ((argv = parse_command(args, &redir)) == NULL) {
+        return 1;
+    }
+    if (argv[0] != NULL) {
+        launch_shell(argv, &redir);
+    }
+    free(argv);
+
+    return 1;
+}
+
+// Interactive Mode's main loop
+void interactive_mode(void) {
+    char *line;
+    char **args;
+    int status;
+
+    do {
+        printf("prompt> ");
+        fflush(stdout);
+        wait_for_input();
+        line = read_line();
+        args = split_line(line); 
+        status = shell_execute(args);
+
+        free(line);
+        free (args);
+        background = 0;
+    } while (status);
+}
+
+// Node states of the batch dependency graph
+#define NODE_WAITING 0
+#define NODE_RUNNING 1
+#define NODE_DONE 2
+#define NODE_BACKOFF 3
+
+#define SH_NODE_BUFSIZE 256
+#define SH_FILE_HASHSIZE 4096
+// Seconds between the SIGTERM and the SIGKILL of a line that timed out
+#define SH_KILL_GRACE 1.0
+// Batch event loop tag of the SIGCHLD signalfd, timers carry their node id
+#define SH_SIGCHLD_EVENT UINT64_MAX
+// The journal goes to disk every SH_JOURNAL_BATCH records or every second
+#define SH_JOURNAL_BATCH 64
+#define SH_JOURNAL_SYNC_NS 1000000000LL
+#define SH_JOURNAL_MAX_LINES (1 << 24)
+
+// Kinds of batch line arguments
+#define FILE_NONE 0
+#define FILE_INPUT 1
+#define FILE_OUTPUT 2
+
+// How often a failed batch line is run again and how long it may take,
+// times are in seconds and 0 means no timeout
+struct batch_policy {
+    int retries;
+    double backoff;
+    double timeout;
+};
+
+// One line of the batch file and the lines that are waiting on it
+struct batch_node {
+    char *line;
+    char **args;
+    int barrier;
+    int deps_left;
+    int *waiters;
+    int nr_waiters;
+    int waiters_size;
+    int id;
+    pid_t pid;
+    int state;
+    struct batch_policy policy;
+    int attempts;
+    int status;
+    int timer_fd;
+    int killed;
+};
+
+// Last line writing a file and the lines reading it since that write
+struct file_entry {
+    char *name;
+    int writer;
+    int *readers;
+    int nr_readers;
+    int readers_size;
+    struct file_entry *next;
+};
+
+struct batch_node *nodes;
+int nr_nodes;
+int *ready_nodes;
+int nr_ready;
+int ready_size;
+struct file_entry *file_table[SH_FILE_HASHSIZE];
+
+// What the journal knows about one batch line from earlier runs, the
+// files are hashed together by kind
+struct journal_entry {
+    uint64_t command;
+    uint64_t inputs;
+    uint64_t outputs;
+    int status;
+    int valid;
+};
+
+// Completion journal of a batch run, resume skips the lines it shows as
+// up to date
+struct journal {
+    int fd;
+    int resume;
+    struct journal_entry *entries;
+    int nr_entries;
+    int unsynced;
+    struct timespec synced;
+};
+
+struct journal journal = { .fd = -1 };
+
+// Policy of lines without a prefix of their own, set by --retry,
+// --backoff and --timeout
+struct batch_policy default_policy;
+
+// Batch event loop, watches SIGCHLD and the timers of the lines
+int batch_epoll_fd = -1;
+
+// Arguments of a line whose policy prefix could not be read
+char *no_args[] = { NULL };
+
+// Checks if the command is run by the shell itself
+int is_builtin(char *command) {
+    int i;
+
+    for (i = 0; i < shell_num_builtins(); i++) {
+        if (strcmp(command, builtin_str[i]) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Grows an int array by SH_NODE_BUFSIZE when it is full
+int *grow_int_array(int *array, int count, int *size) {
+    if (count < *size) {
+        return array;
+    }
+
+    *size += SH_NODE_BUFSIZE;
+    array = realloc(array, *size * sizeof(int));
+    if (!array) {
+        fprintf(stderr, "shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return array;
+}
+
+// Queues a node whose dependencies have all finished
+void push_ready(int id) {
+    ready_nodes = grow_int_array(ready_nodes, nr_ready, &ready_size);
+    ready_nodes[nr_ready++] = id;
+}
+
+// Makes node wait for dep unless dep already finished
+void add_dependency(int node, int dep) {
+    struct batch_node *d;
+
+    if (dep < 0 || dep == node || nodes[dep].state == NODE_DONE) {
+        return;
+    }
+    d = &nodes[dep];
+    // Waiters are added in line order so a repeat is always the last one
+    if (d->nr_waiters > 0 && d->waiters[d->nr_waiters - 1] == node) {
+        return;
+    }
+
+    d->waiters = grow_int_array(d->waiters, d->nr_waiters, &d->waiters_size);
+    d->waiters[d->nr_waiters++] = node;
+    nodes[node].deps_left++;
+}
+
+// Finds the table entry of a file, creating it the first time it is seen
+struct file_entry *get_file_entry(char *name) {
+    unsigned long hash = 5381;
+    char *c;
+    struct file_entry *entry;
+
+    for (c = name; *c != '\0'; c++) {
+        hash = hash * 33 + (unsigned char) *c;
+    }
+    hash %= SH_FILE_HASHSIZE;
+
+    for (entry = file_table[hash]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+
+    entry = calloc(1, sizeof(struct file_entry));
+    if (!entry) {
+        fprintf(stderr, "shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    entry->name = name;
+    entry->writer = -1;
+    entry->next = file_table[hash];
+    file_table[hash] = entry;
+
+    return entry;
+}
+
+// A line reading a file has to wait for the last line that wrote it
+void add_input(int node, char *name) {
+    struct file_entry *entry = get_file_entry(name);
+
+    add_dependency(node, entry->writer);
+    entry->readers = grow_int_array(entry->readers, entry->nr_readers, &entry->readers_size);
+    entry->readers[entry->nr_readers++] = node;
+}
+
+// A line writing a file has to wait for everyone still using the old one
+void add_output(int node, char *name) {
+    struct file_entry *entry = get_file_entry(name);
+    int i;
+
+    add_dependency(node, entry->writer);
+    for (i = 0; i < entry->nr_readers; i++) {
+        add_dependency(node, entry->readers[i]);
+    }
+
+    entry->writer = node;
+    entry->nr_readers = 0;
+}
+
+// Reads a duration like 500ms, 2s or 1m, plain numbers are seconds
+// Returns 0 when the text is a valid duration
+int parse_duration(const char *text, double *seconds) {
+    char *end;
+    double value = strtod(text, &end);
+
+    if (end == text || value < 0) {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0) {
+        value /= 1000;
+    } else if (strcmp(end, "m") == 0) {
+        value *= 60;
+    } else if (*end != '\0' && strcmp(end, "s") != 0) {
+        return -1;
+    }
+
+    *seconds = value;
+    return 0;
+}
+
+// Reads one retry, backoff= or timeout= setting into policy, i is the
+// index of the setting in args and is moved past its value
+// Returns 0 when the setting is valid
+int parse_policy_setting(char **args, int *i, int end, struct batch_policy *policy) {
+    char *stop;
+    long retries;
+
+    if (strcmp(args[*i], "retry") == 0 && *i + 1 < end) {
+        retries = strtol(args[*i + 1], &stop, 10);
+        if (*stop != '\0' || stop == args[*i + 1] || retries < 0 || retries > INT_MAX) {
+            return -1;
+        }
+        policy->retries = (int) retries;
+        (*i)++;
+        return 0;
+    } else if (strncmp(args[*i], "backoff=", 8) == 0) {
+        return parse_duration(args[*i] + 8, &policy->backoff);
+    } else if (strncmp(args[*i], "timeout=", 8) == 0) {
+        return parse_duration(args[*i] + 8, &policy->timeout);
+    }
+
+    return -1;
+}
+
+// Takes a retry N backoff=T timeout=T -- prefix off a batch line into
+// policy. Returns the command after the prefix, args itself when there
+// is none, or NULL when the prefix is malformed
+char **parse_policy(char **args, struct batch_policy *policy) {
+    int end, i;
+
+    if (args[0] == NULL || (strcmp(args[0], "retry") != 0
+            && strncmp(args[0], "backoff=", 8) != 0 && strncmp(args[0], "timeout=", 8) != 0)) {
+        return args;
+    }
+    for (end = 0; args[end] != NULL && strcmp(args[end], "--") != 0; end++) {
+    }
+    if (args[end] == NULL) {
+        return args;
+    }
+
+    for (i = 0; i < end; i++) {
+        if (parse_policy_setting(args, &i, end, policy) < 0) {
+            fprintf(stderr, "shell: bad retry or timeout setting: %s\n", args[i]);
+            return NULL;
+        }
+    }
+
+    return args + end + 1;
+}
+
+// Whether a policy changes anything about how a line is run
+int policy_active(struct batch_policy *policy) {
+    return policy->retries > 0 || policy->timeout > 0;
+}
+
+// Arms the node's timer to fire once after seconds, creating the timerfd
+// and adding it to the batch event loop the first time
+void arm_timer(struct batch_node *node, double seconds) {
+    struct itimerspec spec = { { 0, 0 }, { 0, 0 } };
+    struct epoll_event event = { .events = EPOLLIN };
+
+    if (node->timer_fd < 0) {
+        node->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (node->timer_fd < 0) {
+            fprintf(stderr, "shell: unable to create a timer\n");
+            exit(EXIT_FAILURE);
+        }
+        event.data.u64 = node->id;
+        epoll_ctl(batch_epoll_fd, EPOLL_CTL_ADD, node->timer_fd, &event);
+    }
+
+    // A zero it_value would disarm the timer instead
+    if (seconds < 0.001) {
+        seconds = 0.001;
+    }
+    spec.it_value.tv_sec = (time_t) seconds;
+    spec.it_value.tv_nsec = (long) ((seconds - spec.it_value.tv_sec) * 1e9);
+    timerfd_settime(node->timer_fd, 0, &spec, NULL);
+}
+
+// Closes the node's timer once the line is over
+void close_timer(struct batch_node *node) {
+    if (node->timer_fd >= 0) {
+        close(node->timer_fd);
+        node->timer_fd = -1;
+    }
+}
+
+// Starts a line, or the next attempt at it, with its timeout armed
+// Returns 1 when a child is running, 0 when the line is already over
+int start_node(struct batch_node *node) {
+    int len = (int) strcspn(node->line, "\n");
+
+    if (node->attempts == 0) {
+        fputs(node->line, stdout);
+        fflush(stdout);
+    } else {
+        fprintf(stderr, "shell: attempt %d of %d: %.*s\n", node->attempts + 1, node->policy.retries + 1, len, node->line);
+    }
+
+    pid = -10;
+    supervised = 1;
+    shell_execute(node->args);
+    supervised = 0;
+    background = 0;
+    node->attempts++;
+    node->killed = 0;
+
+    if (pid <= 0) {
+        node->status = -1;
+        close_timer(node);
+        return 0;
+    }
+    node->pid = pid;
+    node->state = NODE_RUNNING;
+    if (node->policy.timeout > 0) {
+        arm_timer(node, node->policy.timeout);
+    }
+
+    return 1;
+}
+
+// Records how the child of a line ended. A failure with retries left
+// arms the backoff timer, doubling the delay on every attempt
+// Returns 1 when the line is over and 0 when it runs again later
+int node_exited(struct batch_node *node, int status) {
+    int len = (int) strcspn(node->line, "\n");
+    double delay;
+
+    node->status = status;
+    node->pid = -1;
+    // Lines without a policy fail quietly, as they did before policies
+    if ((WIFEXITED(status) && WEXITSTATUS(status) == 0) || !policy_active(&node->policy)) {
+        close_timer(node);
+        return 1;
+    }
+
+    if (node->killed) {
+        fprintf(stderr, "shell: timed out after %gs: %.*s\n", node->policy.timeout, len, node->line);
+    } else if (WIFEXITED(status)) {
+        fprintf(stderr, "shell: exit status %d: %.*s\n", WEXITSTATUS(status), len, node->line);
+    } else if (WIFSIGNALED(status)) {
+        fprintf(stderr, "shell: killed by signal %d: %.*s\n", WTERMSIG(status), len, node->line);
+    }
+    if (node->attempts > node->policy.retries) {
+        if (node->policy.retries > 0) {
+            fprintf(stderr, "shell: giving up after %d attempts: %.*s\n", node->attempts, len, node->line);
+        }
+        close_timer(node);
+        return 1;
+    }
+
+    delay = node->policy.backoff * (double) (1 << (node->attempts - 1 < 16 ? node->attempts - 1 : 16));
+    node->state = NODE_BACKOFF;
+    arm_timer(node, delay);
+    return 0;
+}
+
+// Handles the node's timer firing. A running line past its timeout gets
+// SIGTERM and, a second later, SIGKILL
+// Returns 1 when the line is due for its next attempt
+int node_timer(struct batch_node *node) {
+    uint64_t expirations;
+
+    while (read(node->timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+    }
+
+    if (node->state == NODE_BACKOFF) {
+        return 1;
+    }
+    if (node->state == NODE_RUNNING && node->pid > 0) {
+        kill(node->pid, node->killed ? SIGKILL : SIGTERM);
+        node->killed = 1;
+        arm_timer(node, SH_KILL_GRACE);
+    }
+
+    return 0;
+}
+
+// Empties the SIGCHLD signalfd, the children are reaped by the caller
+void drain_sigchld(void) {
+    struct signalfd_siginfo info;
+
+    while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+}
+
+// Waits for the next child or timer event of the batch. Only a signal may
+// cut the wait short, any other error would turn the loop into a busy
+// wait, so the batch is abandoned
+void wait_batch_event(struct epoll_event *event) {
+    int count;
+
+    while ((count = epoll_wait(batch_epoll_fd, event, 1, -1)) != 1) {
+        if (count < 0 && errno != EINTR) {
+            perror("shell: batch event loop");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Runs one line until it is over, retries included, in sequential batch mode
+void run_node(struct batch_node *node) {
+    struct epoll_event event;
+    int status;
+
+    if (!start_node(node)) {
+        return;
+    }
+
+    while (1) {
+        wait_batch_event(&event);
+        if (event.data.u64 == SH_SIGCHLD_EVENT) {
+            drain_sigchld();
+            if (node->state == NODE_RUNNING && waitpid(node->pid, &status, WNOHANG) == node->pid
+                    && node_exited(node, status)) {
+                return;
+            }
+        } else if (node_timer(node) && !start_node(node)) {
+            return;
+        }
+    }
+}
+
+// Tells whether args[*i] names a file the line reads or writes. Outputs are
+// the targets of >, >>, 2> and -O, every other word may be an input. *i is
+// moved onto the file name after an operator
+int file_argument(char **args, int *i) {
+    int type = token_type(args[*i]);
+
+    if (type == TOKEN_OUTPUT || type == TOKEN_APPEND || type == TOKEN_ERROR
+            || (type == TOKEN_WORD && strcmp(args[*i], "-O") == 0)) {
+        if (args[*i + 1] == NULL) {
+            return FILE_NONE;
+        }
+        (*i)++;
+        return FILE_OUTPUT;
+    } else if (type == TOKEN_INPUT) {
+        if (args[*i + 1] == NULL) {
+            return FILE_NONE;
+        }
+        (*i)++;
+        return FILE_INPUT;
+    } else if (type == TOKEN_WORD && args[*i][0] != '-') {
+        return FILE_INPUT;
+    }
+    return FILE_NONE;
+}
+
+// Works out which earlier lines this line depends on from its file arguments
+// Outputs are the targets of > and -O, every other argument may be an input
+void add_batch_node(char *line, char **args, int *last_barrier) {
+    int id = nr_nodes, i, kind;
+    struct batch_node *node;
+
+    if (nr_nodes % SH_NODE_BUFSIZE == 0) {
+        nodes = realloc(nodes, (nr_nodes + SH_NODE_BUFSIZE) * sizeof(struct batch_node));
+        if (!nodes) {
+            fprintf(stderr, "shell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    node = &nodes[nr_nodes++];
+    memset(node, 0, sizeof(struct batch_node));
+    node->policy = default_policy;
+    if ((args = parse_policy(args, &node->policy)) == NULL) {
+        args = no_args;
+    }
+    node->id = id;
+    node->line = line;
+    node->args = args;
+    node->pid = -1;
+    node->timer_fd = -1;
+    node->state = NODE_WAITING;
+    node->barrier = args[0] != NULL && is_builtin(args[0]);
+
+    // Builtins like cd or barrier split the batch, they wait for every
+    // line before them and every line after them waits for them
+    if (node->barrier) {
+        for (i = *last_barrier + 1; i < id; i++) {
+            add_dependency(id, i);
+        }
+        *last_barrier = id;
+        if (node->deps_left == 0) {
+            push_ready(id);
+        }
+        return;
+    }
+    add_dependency(id, *last_barrier);
+
+    for (i = 1; args[0] != NULL && args[i] != NULL; i++) {
+        if ((kind = file_argument(args, &i)) == FILE_OUTPUT) {
+            add_output(id, args[i]);
+        } else if (kind == FILE_INPUT) {
+            add_input(id, args[i]);
+        }
+    }
+
+    if (nodes[id].deps_left == 0) {
+        push_ready(id);
+    }
+}
+
+// Marks a node as finished and releases the lines waiting on it
+void finish_node(int id) {
+    struct batch_node *node = &nodes[id];
+    int i;
+
+    node->state = NODE_DONE;
+    for (i = 0; i < node->nr_waiters; i++) {
+        if (--nodes[node->waiters[i]].deps_left == 0) {
+            push_ready(node->waiters[i]);
+        }
+    }
+}
+
+// A batch line parsed ahead of time, text is the line as written for the
+// echo and args point into a second copy that split_line cut up
+struct batch_line {
+    char *text;
+    char **args;
+};
+
+// Batch file stream, a producer thread parses up to SH_READAHEAD lines
+// ahead of the launcher into a ring of ready to run lines. A compiled
+// batch file needs no parsing and is read straight from its mapping
+struct batch_reader {
+    FILE *fp;
+    char *image;
+    size_t image_size;
+    struct image_line *lines;
+    uint32_t *argv;
+    char *strings;
+    uint32_t nr_lines;
+    uint32_t next_line;
+    char *map;
+    size_t map_size;
+    size_t map_pos;
+    struct batch_line ring[SH_READAHEAD];
+    int head;
+    int count;
+    int eof;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_t producer;
+};
+
+// Header of a compiled batch file. The source is identified by its mtime,
+// size and a hash of its contents, offsets are into the string table
+struct image_header {
+    char magic[4];
+    uint32_t version;
+    int64_t src_mtime_sec;
+    int64_t src_mtime_nsec;
+    uint64_t src_size;
+    uint64_t src_hash;
+    uint32_t nr_lines;
+    uint32_t nr_argv;
+    uint32_t strings_size;
+};
+
+// A line of a compiled batch file, argv is the index of its first argument
+// in the argv table and text is the line as written for the echo
+struct image_line {
+    uint32_t text;
+    uint32_t argv;
+    uint32_t argc;
+};
+
+// Strings of a batch file being compiled, every distinct string is stored
+// once and found again through an open addressing table of offsets
+struct intern_table {
+    char *strings;
+    size_t strings_len;
+    size_t strings_size;
+    uint32_t *slots;
+    size_t size;
+    size_t count;
+};
+
+// Returns the name of the compiled form of a batch file, foo.bat -> foo.batc
+char *image_path(const char *batch_file_name) {
+    size_t len = strlen(batch_file_name);
+    char *path = malloc(len + 2);
+
+    if (!path) {
+        fprintf(stderr, "shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(path, batch_file_name, len);
+    path[len] = 'c';
+    path[len + 1] = '\0';
+    return path;
+}
+
+// Finds the slot of a string, either the one holding it or the empty one
+// where it belongs
+size_t intern_slot(struct intern_table *table, const char *text, size_t len) {
+    size_t mask = table->size - 1;
+    size_t i = word_hash(text, len) & mask;
+    const char *stored;
+
+    while (table->slots[i] != 0) {
+        stored = table->strings + table->slots[i] - 1;
+        if (strncmp(stored, text, len) == 0 && stored[len] == '\0') {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Returns the offset of a string in the table, adding it the first time
+uint32_t intern_string(struct intern_table *table, const char *text, size_t len) {
+    uint32_t *old_slots = table->slots;
+    size_t old_size = table->size, i, slot;
+
+    if (table->count * 2 >= table->size) {
+        table->size = table->size ? table->size * 2 : SH_WORD_TABLESIZE;
+        table->slots = calloc(table->size, sizeof(uint32_t));
+        if (!table->slots) {
+            fprintf(stderr, "shell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < old_size; i++) {
+            if (old_slots[i] != 0) {
+                const char *stored = table->strings + old_slots[i] - 1;
+                table->slots[intern_slot(table, stored, strlen(stored))] = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+
+    slot = intern_slot(table, text, len);
+    if (table->slots[slot] != 0) {
+        return table->slots[slot] - 1;
+    }
+
+    while (table->strings_len + len + 1 > table->strings_size) {
+        table->strings_size = table->strings_size ? table->strings_size * 2 : SH_RL_BUFSIZE;
+        table->strings = realloc(table->strings, table->strings_size);
+        if (!table->strings) {
+            fprintf(stderr, "shell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(table->strings + table->strings_len, text, len);
+    table->strings[table->strings_len + len] = '\0';
+    table->slots[slot] = table->strings_len + 1;
+    table->strings_len += len + 1;
+    table->count++;
+
+    return table->slots[slot] - 1;
+}
+
+// Maps a whole file read only, returns NULL for empty or unreadable files
+char *map_file(int fd, size_t size) {
+    char *map;
+
+    if (size == 0) {
+        return NULL;
+    }
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+// Writes the parsed form of a batch file next to it, batch mode launches
+// straight from it for as long as the source is unchanged
+int compile_batch(char *batch_file_name) {
+    struct intern_table table = { 0 };
+    struct image_header header = { .magic = SH_IMAGE_MAGIC, .version = SH_IMAGE_VERSION };
+    struct image_line *lines = NULL;
+    uint32_t *argv = NULL;
+    size_t lines_size = 0, argv_size = 0, pos = 0, len;
+    char *map, *copy, **args, *path, *tmp_path, *end;
+    struct stat st;
+    FILE *out;
+    int fd, i;
+
+    if ((fd = open(batch_file_name, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "shell: %s: %s\n", batch_file_name, strerror(errno));
+        return -1;
+    }
+    map = map_file(fd, st.st_size);
+    if (map == NULL && st.st_size > 0) {
+        fprintf(stderr, "shell: %s: unable to map the file\n", batch_file_name);
+        close(fd);
+        return -1;
+    }
+
+    header.src_mtime_sec = st.st_mtim.tv_sec;
+    header.src_mtime_nsec = st.st_mtim.tv_nsec;
+    header.src_size = st.st_size;
+    header.src_hash = word_hash(map, st.st_size);
+
+    while (pos < (size_t) st.st_size) {
+        end = memchr(map + pos, '\n', st.st_size - pos);
+        len = end != NULL ? (size_t) (end - map - pos) + 1 : st.st_size - pos;
+
+        if (header.nr_lines == lines_size) {
+            lines_size = lines_size ? lines_size * 2 : SH_TOK_BUFSIZE;
+            lines = realloc(lines, lines_size * sizeof(struct image_line));
+            if (!lines) {
+                fprintf(stderr, "shell: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        copy = malloc(len + 1);
+        if (!copy) {
+            fprintf(stderr, "shell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(copy, map + pos, len);
+        copy[len] = '\0';
+
+        lines[header.nr_lines].text = intern_string(&table, map + pos, len);
+        lines[header.nr_lines].argv = header.nr_argv;
+        args = split_line(copy);
+        for (i = 0; args[i] != NULL; i++) {
+            if (header.nr_argv == argv_size) {
+                argv_size = argv_size ? argv_size * 2 : SH_RL_BUFSIZE;
+                argv = realloc(argv, argv_size * sizeof(uint32_t));
+                if (!argv) {
+                    fprintf(stderr, "shell: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            if (token_type(args[i]) != TOKEN_WORD) {
+                argv[header.nr_argv++] = SH_IMAGE_OPERATOR + token_type(args[i]);
+            } else {
+                argv[header.nr_argv++] = intern_string(&table, args[i], strlen(args[i]));
+            }
+        }
+        lines[header.nr_lines++].argc = i;
+
+        free(args);
+        free(copy);
+        pos += len;
+    }
+    header.strings_size = table.strings_len;
+
+    if (map != NULL) {
+        munmap(map, st.st_size);
+    }
+    close(fd);
+
+    // Written under a temporary name so a batch run never maps half a file
+    path = image_path(batch_file_name);
+    tmp_path = malloc(strlen(path) + 5);
+    if (!tmp_path) {
+        fprintf(stderr, "shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    if ((out = fopen(tmp_path, "wb")) == NULL
+            || fwrite(&header, sizeof(header), 1, out) != 1
+            || fwrite(lines, sizeof(struct image_line), header.nr_lines, out) != header.nr_lines
+            || fwrite(argv, sizeof(uint32_t), header.nr_argv, out) != header.nr_argv
+            || fwrite(table.strings, 1, table.strings_len, out) != table.strings_len
+            || fclose(out) != 0
+            || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "shell: unable to write %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    free(lines);
+    free(argv);
+    free(table.strings);
+    free(table.slots);
+    free(tmp_path);
+    free(path);
+
+    return 0;
+}
+
+// Maps the compiled form of a batch file if it was built from the source
+// as it is now. The mtime settles it, otherwise a source of the same size
+// is hashed in case it was rewritten with the same contents
+int load_image(struct batch_reader *reader, char *batch_file_name, FILE *fp) {
+    const struct image_header *header;
+    struct stat src, st;
+    char *path, *map, *src_map;
+    size_t tables;
+    uint32_t i;
+    int fd, valid;
+
+    path = image_path(batch_file_name);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) < 0 || fstat(fileno(fp), &src) < 0 || (size_t) st.st_size < sizeof(struct image_header)) {
+        close(fd);
+        return 0;
+    }
+    // Private and writable so the launch path may treat argv as its own
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    header = (const struct image_header *) map;
+    tables = (size_t) header->nr_lines * sizeof(struct image_line) + (size_t) header->nr_argv * sizeof(uint32_t);
+    valid = memcmp(header->magic, SH_IMAGE_MAGIC, 4) == 0
+        && header->version == SH_IMAGE_VERSION
+        && sizeof(struct image_header) + tables + header->strings_size == (size_t) st.st_size
+        && (header->strings_size == 0 || map[st.st_size - 1] == '\0')
+        && header->src_size == (uint64_t) src.st_size;
+
+    if (valid && (header->src_mtime_sec != src.st_mtim.tv_sec || header->src_mtime_nsec != src.st_mtim.tv_nsec)) {
+        src_map = map_file(fileno(fp), src.st_size);
+        valid = (src_map != NULL || src.st_size == 0) && word_hash(src_map, src.st_size) == header->src_hash;
+        if (src_map != NULL) {
+            munmap(src_map, src.st_size);
+        }
+    }
+
+    if (!valid) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    reader->lines = (struct image_line *) (map + sizeof(struct image_header));
+    reader->argv = (uint32_t *) (reader->lines + header->nr_lines);
+    reader->strings = (char *) (reader->argv + header->nr_argv);
+    reader->nr_lines = header->nr_lines;
+
+    // Every offset has to land inside the tables before anything trusts it
+    for (i = 0; valid && i < header->nr_lines; i++) {
+        valid = reader->lines[i].text < header->strings_size
+            && reader->lines[i].argv <= header->nr_argv
+            && reader->lines[i].argc <= header->nr_argv - reader->lines[i].argv;
+    }
+    for (i = 0; valid && i < header->nr_argv; i++) {
+        valid = reader->argv[i] < header->strings_size || (reader->argv[i] > SH_IMAGE_OPERATOR
+            && reader->argv[i] <= SH_IMAGE_OPERATOR + TOKEN_BACKGROUND);
+    }
+    if (!valid) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    reader->image = map;
+    reader->image_size = st.st_size;
+    return 1;
+}
+
+// Builds the next line straight out of the compiled form, only the argv
+// array is allocated since the launch path edits it
+int image_next(struct batch_reader *reader, struct batch_line *line) {
+    const struct image_line *record;
+    uint32_t i;
+
+    if (reader->next_line == reader->nr_lines) {
+        return -1;
+    }
+    record = &reader->lines[reader->next_line++];
+
+    line->text = reader->strings + record->text;
+    line->args = malloc((record->argc + 1) * sizeof(char*));
+    if (!line->args) {
+        fprintf(stderr, "shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    // Operators come back as the strings split_line would have used
+    for (i = 0; i < record->argc; i++) {
+        if (reader->argv[record->argv + i] > SH_IMAGE_OPERATOR) {
+            line->args[i] = OPERATOR_STRING[reader->argv[record->argv + i] - SH_IMAGE_OPERATOR];
+        } else {
+            line->args[i] = reader->strings + reader->argv[record->argv + i];
+        }
+    }
+    line->args[i] = NULL;
+
+    return 1;
+}
+
+// Gets the next raw line from the mapped file, or from stdio when the
+// batch file could not be mapped. Returns 0 at the end of the file
+int next_raw_line(struct batch_reader *reader, const char **start, size_t *len, char **getline_buf, size_t *getline_len) {
+    ssize_t read;
+    char *end;
+
+    if (reader->map != NULL) {
+        if (reader->map_pos >= reader->map_size) {
+            return 0;
+        }
+        *start = reader->map + reader->map_pos;
+        end = memchr(*start, '\n', reader->map_size - reader->map_pos);
+        *len = end != NULL ? (size_t) (end - *start) + 1 : reader->map_size - reader->map_pos;
+        reader->map_pos += *len;
+        return 1;
+    }
+
+    if ((read = getline(getline_buf, getline_len, reader->fp)) == -1) {
+        return 0;
+    }
+    *start = *getline_buf;
+    *len = read;
+    return 1;
+}
+
+// Producer thread, parses lines into the ring and waits while it is full
+void *batch_producer(void *arg) {
+    struct batch_reader *reader = arg;
+    struct batch_line line;
+    char *getline_buf = NULL, *copy;
+    size_t getline_len = 0, len;
+    const char *start;
+
+    while (next_raw_line(reader, &start, &len, &getline_buf, &getline_len)) {
+        // One buffer holds both the echo text and the copy split_line cuts up
+        line.text = malloc(2 * len + 2);
+        if (!line.text) {
+            fprintf(stderr, "shell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(line.text, start, len);
+        line.text[len] = '\0';
+        copy = line.text + len + 1;
+        memcpy(copy, start, len);
+        copy[len] = '\0';
+        line.args = split_line(copy);
+
+        pthread_mutex_lock(&reader->lock);
+        while (reader->count == SH_READAHEAD) {
+            pthread_cond_wait(&reader->not_full, &reader->lock);
+        }
+        reader->ring[(reader->head + reader->count) % SH_READAHEAD] = line;
+        reader->count++;
+        pthread_cond_signal(&reader->not_empty);
+        pthread_mutex_unlock(&reader->lock);
+    }
+
+    free(getline_buf);
+
+    pthread_mutex_lock(&reader->lock);
+    reader->eof = 1;
+    pthread_cond_signal(&reader->not_empty);
+    pthread_mutex_unlock(&reader->lock);
+
+    return NULL;
+}
+
+// Maps the compiled form of the batch file if it is up to date, otherwise
+// maps the batch file itself and starts the producer thread
+void batch_reader_open(struct batch_reader *reader, char *batch_file_name, FILE *fp) {
+    struct stat st;
+
+    memset(reader, 0, sizeof(struct batch_reader));
+    reader->fp = fp;
+    if (load_image(reader, batch_file_name, fp)) {
+        return;
+    }
+
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        reader->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (reader->map == MAP_FAILED) {
+            reader->map = NULL;
+        } else {
+            reader->map_size = st.st_size;
+            posix_madvise(reader->map, st.st_size, POSIX_MADV_SEQUENTIAL);
+        }
+    }
+
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->not_empty, NULL);
+    pthread_cond_init(&reader->not_full, NULL);
+    pthread_create(&reader->producer, NULL, batch_producer, reader);
+}
+
+// Takes the next parsed line, blocking only if wait is set and the producer
+// is behind. Returns 0 when no line is available, -1 at the end of the file
+int batch_reader_next(struct batch_reader *reader, struct batch_line *line, int wait) {
+    int result = 1;
+
+    if (reader->image != NULL) {
+        return image_next(reader, line);
+    }
+
+    pthread_mutex_lock(&reader->lock);
+    while (wait && reader->count == 0 && !reader->eof) {
+        pthread_cond_wait(&reader->not_empty, &reader->lock);
+    }
+
+    if (reader->count > 0) {
+        *line = reader->ring[reader->head];
+        reader->head = (reader->head + 1) % SH_READAHEAD;
+        reader->count--;
+        pthread_cond_signal(&reader->not_full);
+    } else {
+        result = reader->eof ? -1 : 0;
+    }
+    pthread_mutex_unlock(&reader->lock);
+
+    return result;
+}
+
+// Frees a line once it has run, text belongs to the mapping for
+// compiled batch files
+void batch_line_release(struct batch_reader *reader, struct batch_line *line) {
+    if (reader->image == NULL) {
+        free(line->text);
+    }
+    free(line->args);
+}
+
+// Waits for the producer and unmaps the file
+void batch_reader_close(struct batch_reader *reader) {
+    if (reader->image != NULL) {
+        munmap(reader->image, reader->image_size);
+        return;
+    }
+    pthread_join(reader->producer, NULL);
+    if (reader->map != NULL) {
+        munmap(reader->map, reader->map_size);
+    }
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->not_empty);
+    pthread_cond_destroy(&reader->not_full);
+}
+
+// Returns the name of the journal of a batch file, foo.bat -> foo.bat.journal
+char *journal_path(const char *batch_file_name) {
+    size_t len = strlen(batch_file_name);
+    char *path = malloc(len + sizeof(".journal"));
+
+    if (!path) {
+        fprintf(stderr, "shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(path, batch_file_name, len);
+    memcpy(path + len, ".journal", sizeof(".journal"));
+    return path;
+}
+
+// Folds value into a running hash
+uint64_t hash_mix(uint64_t hash, uint64_t value) {
+    return (hash ^ value) * 1099511628211ULL;
+}
+
+// Hash of a file's name and contents, a missing file hashes as its name
+uint64_t hash_file(const char *name) {
+    uint64_t hash = word_hash(name, strlen(name));
+    struct stat st;
+    char *map;
+    int fd;
+
+    if ((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0) {
+        return hash;
+    }
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        hash = hash_mix(hash, (uint64_t) st.st_size);
+        if ((map = map_file(fd, st.st_size)) != NULL) {
+            hash = hash_mix(hash, word_hash(map, st.st_size));
+            munmap(map, st.st_size);
+        }
+    }
+    close(fd);
+
+    return hash;
+}
+
+// Hashes the input and the output files of a line, found the way the
+// dependency graph finds them
+void hash_line_files(char **args, uint64_t *inputs, uint64_t *outputs) {
+    int i, kind;
+
+    *inputs = 0;
+    *outputs = 0;
+    for (i = 1; args[0] != NULL && args[i] != NULL; i++) {
+        if ((kind = file_argument(args, &i)) == FILE_INPUT) {
+            *inputs = hash_mix(*inputs, hash_file(args[i]));
+        } else if (kind == FILE_OUTPUT) {
+            *outputs = hash_mix(*outputs, hash_file(args[i]));
+        }
+    }
+}
+
+// Exit code of a wait status as the journal keeps it, -1 when unknown
+int journal_status(int status) {
+    if (status < 0) {
+        return -1;
+    } else if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return -1;
+}
+
+// Opens the journal of a batch file. A fresh run starts it over, --resume
+// reads what the last runs completed and adds to it
+void journal_open(char *batch_file_name, int resume) {
+    char *path = journal_path(batch_file_name), text[SH_RL_BUFSIZE];
+    unsigned long long command, inputs, outputs;
+    int line, status, size = 0;
+    FILE *fp;
+
+    journal.resume = resume;
+    if (resume && (fp = fopen(path, "r")) != NULL) {
+        while (fgets(text, sizeof(text), fp) != NULL) {
+            if (sscanf(text, "%d %llx %d %llx %llx", &line, &command, &status, &inputs, &outputs) != 5 || line < 0 || line >= SH_JOURNAL_MAX_LINES) {
+                continue;
+            }
+            // Later records of a line replace earlier ones
+            if (line >= size) {
+                journal.entries = realloc(journal.entries, (line + SH_NODE_BUFSIZE) * sizeof(struct journal_entry));
+                if (!journal.entries) {
+                    fprintf(stderr, "shell: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+                memset(journal.entries + size, 0, (line + SH_NODE_BUFSIZE - size) * sizeof(struct journal_entry));
+                size = line + SH_NODE_BUFSIZE;
+            }
+            if (line >= journal.nr_entries) {
+                journal.nr_entries = line + 1;
+            }
+            journal.entries[line].command = command;
+            journal.entries[line].inputs = inputs;
+            journal.entries[line].outputs = outputs;
+            journal.entries[line].status = status;
+            journal.entries[line].valid = 1;
+        }
+        fclose(fp);
+    }
+
+    journal.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0644);
+    if (journal.fd < 0) {
+        fprintf(stderr, "shell: unable to open the journal %s: %s\n", path, strerror(errno));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &journal.synced);
+    free(path);
+}
+
+// Whether a line finished cleanly in an earlier run with the same command,
+// and its input and output files are still what they were then
+int journal_up_to_date(int line, char *text, char **args) {
+    struct journal_entry *entry;
+    uint64_t inputs, outputs;
+
+    if (!journal.resume || line >= journal.nr_entries || args[0] == NULL || is_builtin(args[0])) {
+        return 0;
+    }
+    entry = &journal.entries[line];
+    if (!entry->valid || entry->status != 0 || entry->command != word_hash(text, strcspn(text, "\n"))) {
+        return 0;
+    }
+
+    hash_line_files(args, &inputs, &outputs);
+    if (inputs != entry->inputs || outputs != entry->outputs) {
+        return 0;
+    }
+
+    fprintf(stderr, "shell: up to date: %.*s\n", (int) strcspn(text, "\n"), text);
+    return 1;
+}
+
+// Flushes the journal to disk
+void journal_sync(void) {
+    if (journal.fd >= 0 && journal.unsynced > 0) {
+        fdatasync(journal.fd);
+        journal.unsynced = 0;
+        clock_gettime(CLOCK_MONOTONIC, &journal.synced);
+    }
+}
+
+// Records a finished line. Each record is written at once so it outlives
+// the shell, but it only reaches the disk with the next batch of records
+void journal_record(int line, char *text, char **args, int status) {
+    char record[128];
+    uint64_t inputs, outputs;
+    struct timespec now;
+    int len;
+
+    if (journal.fd < 0 || args[0] == NULL) {
+        return;
+    }
+
+    hash_line_files(args, &inputs, &outputs);
+    len = snprintf(record, sizeof(record), "%d %016llx %d %016llx %016llx\n", line,
+        (unsigned long long) word_hash(text, strcspn(text, "\n")), journal_status(status),
+        (unsigned long long) inputs, (unsigned long long) outputs);
+    if (write(journal.fd, record, len) != len) {
+        fprintf(stderr, "shell: unable to write the journal: %s\n", strerror(errno));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (++journal.unsynced >= SH_JOURNAL_BATCH
+            || (now.tv_sec - journal.synced.tv_sec) * 1000000000LL + now.tv_nsec - journal.synced.tv_nsec >= SH_JOURNAL_SYNC_NS) {
+        journal_sync();
+    }
+}
+
+// Runs the batch file as a dependency graph, every line starts as soon as
+// the lines producing its input files are done and a pool slot is free.
+// Lines join the graph as the reader parses them, so launching starts
+// before the whole file has been read
+void batch_schedule(struct batch_reader *reader) {
+    int last_barrier = -1, next_ready = 0, done = 0, eof = 0, nr_backoff = 0, result, status, i;
+    struct batch_line line;
+    struct epoll_event event;
+    pid_t child;
+
+    while (1) {
+        // Take in whatever the reader has parsed so far
+        while (!eof && (result = batch_reader_next(reader, &line, 0)) != 0) {
+            if (result < 0) {
+                eof = 1;
+            } else {
+                add_batch_node(line.text, line.args, &last_barrier);
+            }
+        }
+
+        // Start everything that is ready while the pool has room
+        while (next_ready < nr_ready && running_jobs < max_jobs) {
+            struct batch_node *node = &nodes[ready_nodes[next_ready++]];
+
+            // The lines it waited on are done, so its inputs are final
+            if (node->attempts == 0 && journal_up_to_date(node - nodes, node->line, node->args)) {
+                finish_node(node - nodes);
+                done++;
+            } else if (!start_node(node)) {
+                journal_record(node - nodes, node->line, node->args, node->status);
+                finish_node(node - nodes);
+                done++;
+            }
+        }
+
+        if (eof && done == nr_nodes) {
+            break;
+        }
+
+        // A free slot is better spent on the next line than on waiting
+        if (!eof && running_jobs < max_jobs && next_ready >= nr_ready) {
+            if (batch_reader_next(reader, &line, 1) < 0) {
+                eof = 1;
+            } else {
+                add_batch_node(line.text, line.args, &last_barrier);
+            }
+            continue;
+        }
+
+        if (running_jobs == 0 && nr_backoff == 0) {
+            if (next_ready >= nr_ready) {
+                fprintf(stderr, "shell: batch file has lines that can never run\n");
+                break;
+            }
+            continue;
+        }
+
+        // Wait for a child or a timer and wake up the lines that needed it
+        wait_batch_event(&event);
+        if (event.data.u64 != SH_SIGCHLD_EVENT) {
+            i = (int) event.data.u64;
+            if (node_timer(&nodes[i])) {
+                nodes[i].state = NODE_WAITING;
+                nr_backoff--;
+                push_ready(i);
+            }
+            continue;
+        }
+
+        drain_sigchld();
+        while ((child = waitpid(-1, &status, WNOHANG)) > 0) {
+            running_jobs--;
+            for (i = 0; i < nr_nodes; i++) {
+                if (nodes[i].state == NODE_RUNNING && nodes[i].pid == child) {
+                    if (node_exited(&nodes[i], status)) {
+                        journal_record(i, nodes[i].line, nodes[i].args, nodes[i].status);
+                        finish_node(i);
+                        done++;
+                    } else {
+                        nr_backoff++;
+                    }
+                    break;
+                }
+            }
+        }
+        if (child < 0 && errno == ECHILD) {
+            running_jobs = 0;
+        }
+    }
+}
+
+void batch_mode(char* batch_file_name, int resume) {
+    struct batch_reader reader;
+    struct batch_line line;
+    struct batch_node node;
+    struct epoll_event event = { .events = EPOLLIN };
+    int line_no = 0;
+    FILE *fp;
+
+    if ((fp = fopen(batch_file_name, "r")) == NULL) {
+        fprintf(stderr, "Unable to open the batch file: %s\n", batch_file_name);
+        exit(EXIT_FAILURE); 
+    }
+
+    // Lines are read and parsed ahead on another thread while these run
+    batch_reader_open(&reader, batch_file_name, fp);
+    journal_open(batch_file_name, resume);
+
+    // Children and the timers of retries and timeouts share one epoll set
+    batch_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    event.data.u64 = SH_SIGCHLD_EVENT;
+    if (batch_epoll_fd < 0 || epoll_ctl(batch_epoll_fd, EPOLL_CTL_ADD, sigchld_fd, &event) < 0) {
+        fprintf(stderr, "shell: unable to set up the event loop\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // With a worker pool, lines only wait for the lines they depend on
+    if (max_jobs > 1) {
+        batch_schedule(&reader);
+    } else {
+        while (batch_reader_next(&reader, &line, 1) > 0) {
+            memset(&node, 0, sizeof(node));
+            node.line = line.text;
+            node.policy = default_policy;
+            node.pid = -1;
+            node.timer_fd = -1;
+            node.args = parse_policy(line.args, &node.policy);
+
+            // Lines with a policy are supervised, the others run as before
+            if (node.args == NULL || journal_up_to_date(line_no, line.text, node.args)) {
+                // Nothing to run
+            } else if (node.args != line.args || policy_active(&node.policy)) {
+                run_node(&node);
+                journal_record(line_no, line.text, node.args, node.status);
+            } else {
+                fputs(line.text, stdout);
+                fflush(stdout);
+                last_status = -1;
+                shell_execute(line.args);
+                journal_record(line_no, line.text, line.args, last_status);
+            }
+            batch_line_release(&reader, &line);
+            line_no++;
+            background = 0;
+            reap_background(0);
+        }
+    }
+
+    // Let the last children of the pool finish before leaving
+    shell_barrier(NULL);
+    journal_sync();
+
+    batch_reader_close(&reader);
+    fclose(fp);
+
+    exit(EXIT_SUCCESS);
+}
+
+int main (int argc, char *argv[]) {  
+    int opt, compile = 0, resume = 0;
+    char *stop;
+    long retries, jobs;
+    struct option long_options[] = {
+        { "compile", no_argument, NULL, 'c' },
+        { "retry", required_argument, NULL, 'r' },
+        { "backoff", required_argument, NULL, 'b' },
+        { "timeout", required_argument, NULL, 't' },
+        { "resume", no_argument, NULL, 'R' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    no_prompt = 0;
+    background = 0;
+    max_jobs = 1;
+    running_jobs = 0;
+
+    // -j N keeps up to N batch children running at once
+    // --compile writes the parsed form of a batch file for later runs
+    // --retry, --backoff and --timeout set the policy of every batch line
+    // --resume skips the lines the journal of the last run shows as done
+    while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            compile = 1;
+            break;
+        case 'R':
+            resume = 1;
+            break;
+        case 'r':
+            retries = strtol(optarg, &stop, 10);
+            if (*stop != '\0' || stop == optarg || retries < 0 || retries > INT_MAX) {
+                fprintf(stderr, "shell: --retry expects a number of retries\n");
+                exit(EXIT_FAILURE);
+            }
+            default_policy.retries = (int) retries;
+            break;
+        case 'b':
+        case 't':
+            if (parse_duration(optarg, opt == 'b' ? &default_policy.backoff : &default_policy.timeout) < 0) {
+                fprintf(stderr, "shell: --%s expects a duration like 500ms or 2s\n", opt == 'b' ? "backoff" : "timeout");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'j':
+            jobs = strtol(optarg, &stop, 10);
+            if (*stop != '\0' || stop == optarg || jobs < 1 || jobs > INT_MAX) {
+                fprintf(stderr, "shell: -j expects a positive number of jobs\n");
+                exit(EXIT_FAILURE);
+            }
+            max_jobs = (int) jobs;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-j <jobs>] [--compile] [--retry <n>] [--backoff <time>] [--timeout <time>] [--resume] [batch file]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (compile) {
+        if (argc - optind != 1) {
+            fprintf(stderr, "shell: --compile expects one batch file\n");
+            exit(EXIT_FAILURE);
+        }
+        return compile_batch(argv[optind]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // The worker pool only applies to batch files
+    if (argc - optind == 0) {
+        max_jobs = 1;
+    }
+
+    pid = -10; // pid not possible
+
+    SH_PID = getpid();
+
+    act_int.sa_handler = signalHandler_int;
+    sigaction(SIGINT, &act_int, 0);
+
+    // Children are reaped by the event loop or the worker pool, never
+    // from inside a signal handler
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    struct epoll_event event = { .events = EPOLLIN };
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (sigchld_fd < 0 || epoll_fd < 0) {
+        fprintf(stderr, "shell: unable to set up the event loop\n");
+        exit(EXIT_FAILURE);
+    }
+    event.data.fd = sigchld_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sigchld_fd, &event);
+    event.data.fd = STDIN_FILENO;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == 0) {
+        // Unbuffered so a line already read by stdio can not hide from epoll
+        setvbuf(stdin, NULL, _IONBF, 0);
+    } else {
+        // Regular files can not be polled but are always readable
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
 
     // Create own process group
     setpgid(SH_PID, SH_PID); // shell process is group leader
@@ -393,15 +2680,15 @@ int main (int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
     
-    if (argc == 1) {
+    if (argc - optind == 0) {
         interactive_mode();
-    } else if (argc == 2) {  
+    } else if (argc - optind == 1) {  
         // Check to see if file is a batch file
-        if ((strcmp(get_filename_ext(argv[1]), "bat")) == 0) {
+        if ((strcmp(get_filename_ext(argv[optind]), "bat")) == 0) {
             printf("Batch Mode\n");
-            batch_mode(argv[1]);
+            batch_mode(argv[optind], resume);
         } else {
-            fprintf(stderr, "File %s is not a batch file\nTherefore we can not run the shell in batch mode\n", argv[1]);
+            fprintf(stderr, "File %s is not a batch file\nTherefore we can not run the shell in batch mode\n", argv[optind]);
         }
     } else {
         fprintf(stderr, "Incorrect number of arguments for the shell\n");
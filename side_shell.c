@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #define _XOPEN_SOURCE 1000
 
 #include <stdio.h>
@@ -7,17 +8,49 @@
 #include <string.h>
 #include <signal.h>
 #include <pwd.h>
-#include <glob.h>
+#include <dirent.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
-
-#define NR_JOBS 20
+#include <limits.h>
+#include <stddef.h>
+#include <spawn.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <getopt.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
+
+#define JOB_TABLE_SIZE 20
 #define PATH_BUFSIZE 1024
 #define COMMAND_BUFSIZE 1024
 #define TOKEN_BUFSIZE 64
-#define TOKEN_DELIMITERS " \t\r\n\a"
+#define PID_TABLE_SIZE 64
+#define COMMAND_TABLE_SIZE 256
+#define DEFAULT_PATH "/bin:/usr/bin"
+#define ZEROCOPY_PIPE_SIZE (1024 * 1024)
+#define ARENA_BLOCK_SIZE 4096
+#define READ_BUFSIZE 4096
+#define PROMPT "prompt> "
+#define HISTORY_FILE ".side_shell_history"
+#define HISTORY_BUCKETS 65536
+#define HISTORY_INDEX_STEP 8192
+#define TRACE_RING_SIZE 8192
+#define TRACE_NAME_SIZE 48
+#define TRACE_IDLE_NS 1000000
+#define CGROUP_CPU_PERIOD 100000
+#define GLOB_CACHE_SIZE 64
+#define GLOB_RACY_NS 20000000
 
 #define BACKGROUND_EXECUTION 0
 #define FOREGROUND_EXECUTION 1
@@ -27,6 +60,22 @@
 #define COMMAND_QUIT 1
 #define COMMAND_CD 2
 #define COMMAND_BARRIER 3
+#define COMMAND_HASH 4
+#define COMMAND_ZEROCOPY 5
+#define COMMAND_JOBS 6
+#define COMMAND_LIMIT 7
+#define COMMAND_JOBMAX 8
+#define COMMAND_WAIT 9
+#define COMMAND_GROUP 10
+#define COMMAND_GROUP_END 11
+
+#define TOKEN_WORD 0
+#define TOKEN_PIPE 1
+#define TOKEN_INPUT 2
+#define TOKEN_OUTPUT 3
+#define TOKEN_APPEND 4
+#define TOKEN_ERROR 5
+#define TOKEN_BACKGROUND 6
 
 #define PROC_FILTER_ALL 0
 #define PROC_FILTER_DONE 1
@@ -37,13 +86,43 @@
 #define STATUS_SUSPENDED 2
 #define STATUS_CONTINUED 3
 #define STATUS_TERMINATED 4
+#define STATUS_OOM_KILLED 5
+#define STATUS_QUEUED 6
+
+#define GLOB_LITERAL 0
+#define GLOB_ANY 1
+#define GLOB_STAR 2
+#define GLOB_SET 3
 
 const char* STATUS_STRING[] = {
     "running",
     "done",
     "suspended",
     "continued",
-    "terminated"
+    "terminated",
+    "oom-killed",
+    "queued"
+};
+
+// Operators as they appear on the command line, indexed by token type
+char *OPERATOR_STRING[] = {
+    "",
+    "|",
+    "<",
+    ">",
+    ">>",
+    "2>",
+    "&"
+};
+
+// A word or operator of a command line, start and end are its span in the
+// line as typed, text is the word after quotes and escapes are removed
+struct token {
+    char *text;
+    int type;
+    int quoted;
+    int start;
+    int end;
 };
 
 struct process {
@@ -52,10 +131,37 @@ struct process {
     char **argv;
     char *input_path;
     char *output_path;
+    char *error_path;
+    int append;
     pid_t pid;
     int type;
     int status;
+    int job_id;
+    struct timespec started;
+    struct timespec finished;
+    struct rusage usage;
     struct process *next;
+    struct process *hash_next;
+};
+
+// Block of a bump allocator, blocks are chained newest first
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) char data[];
+};
+
+// Holds every allocation made while parsing one job
+struct arena {
+    struct arena_block *head;
+};
+
+// Resources a job may use, mem in bytes and cpus as a number of CPUs,
+// 0 means no limit
+struct job_limits {
+    long long mem;
+    double cpus;
 };
 
 struct job {
@@ -64,41 +170,297 @@ struct job {
     char *command;
     pid_t pgid;
     int mode;
+    int timed;
+    int has_limits;
+    struct job_limits limits;
+    char *cgroup;
+    long long throttled_usec;
+    int queued;
+    struct job *queue_next;
+    char *group;
+    struct arena arena;
+};
+
+// Cached absolute path of a command found in $PATH
+struct command_path {
+    char *name;
+    char *path;
+    int hits;
+    struct command_path *next;
 };
 
 struct shell_info {
     char cur_user[TOKEN_BUFSIZE];
     char cur_dir[PATH_BUFSIZE];
     char pw_dir[PATH_BUFSIZE];
-    struct job *jobs[NR_JOBS + 1];
+    struct job **jobs;
+    int jobs_size;
+    int max_job_id;
+    int *free_ids;
+    int nr_free_ids;
+    struct process **pid_table;
+    int pid_table_size;
+    int nr_pids;
+    int epoll_fd;
+    int signal_fd;
+    struct command_path *command_table[COMMAND_TABLE_SIZE];
+    char *hashed_path;
+    int pipe_size;
+    FILE *usage_log;
+    struct job_limits default_limits;
+    char *cgroup_parent;
+    pid_t cgroup_owner;
+    int cgroup_state;
+    int cgroup_seq;
+    int max_background;
+    int nr_background;
+    struct job *queue_head;
+    struct job *queue_tail;
+    char *group;
+};
+
+// Line being edited at the prompt, input holds what was read from stdin
+// but not handled yet, which may run past the end of the current line
+struct line_editor {
+    char *buf;
+    size_t len;
+    size_t size;
+    size_t cursor;
+    char input[READ_BUFSIZE];
+    size_t input_pos;
+    size_t input_len;
+    int escape;
+    int tty;
+    int eof;
+    int history_pos;
+    char *saved;
+    size_t saved_len;
+    int searching;
+    char query[COMMAND_BUFSIZE];
+    size_t query_len;
+    int match;
+};
+
+// Entries of a trigram bucket in the history index, in id order
+struct history_postings {
+    int *ids;
+    int count;
+    int size;
+};
+
+// Command history, the log on disk is mapped read only and split into
+// entries on first use, lines of this session are kept alongside it
+struct history {
+    char *map;
+    size_t map_size;
+    int fd;
+    size_t *offsets;
+    int nr_mapped;
+    int loaded;
+    char **added;
+    int nr_added;
+    int added_size;
+    int count;
+    struct history_postings *buckets;
+    int indexed;
+};
+
+// A timestamped event of the execution trace, phase is the Chrome trace
+// event type and tid 0 stands for the shell itself
+struct trace_event {
+    uint64_t ts;
+    uint64_t dur;
+    char phase;
+    int tid;
+    int job_id;
+    char name[TRACE_NAME_SIZE];
+};
+
+// Ring of trace events between the shell and the writer thread, head is
+// only moved by the shell and tail only by the writer
+struct trace_ring {
+    struct trace_event events[TRACE_RING_SIZE];
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    _Atomic int stop;
+    FILE *fp;
+    pthread_t writer;
+    pid_t owner;
+    uint64_t start;
+    size_t written;
+};
+
+// Entry of a directory listing, name is an offset into the listing's names
+struct dir_entry {
+    size_t name;
+    unsigned char type;
+};
+
+// Sorted listing of a directory, valid while the directory keeps its
+// device, inode and mtime. A listing read within GLOB_RACY_NS of the
+// mtime may have missed a change made in the same tick and is read again.
+// Pinned listings are being walked and are never evicted or reread, path
+// is NULL for a listing that did not fit in the cache
+struct dir_listing {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int racy;
+    int pins;
+    unsigned long used;
+    char *names;
+    size_t names_size;
+    struct dir_entry *entries;
+    size_t entries_size;
+    size_t count;
+};
+
+// Part of a compiled glob component, text and len for a literal run and
+// set as a 256 bit map for a bracket expression
+struct glob_op {
+    int type;
+    const char *text;
+    size_t len;
+    unsigned char *set;
+};
+
+// Component of a glob pattern between two slashes
+struct glob_component {
+    char *text;
+    struct glob_op *ops;
+    int nr_ops;
+    int literal;
+    int globstar;
+};
+
+// Words a glob produced, packed one after the other into buf
+struct glob_results {
+    char *buf;
+    size_t len;
+    size_t size;
+    size_t *offsets;
+    size_t count;
+    size_t offsets_size;
+};
+
+// Expansion of one pattern, path holds the directory being matched
+struct glob_walk {
+    struct glob_component *comps;
+    int nr_comps;
+    int dir_only;
+    char path[PATH_BUFSIZE * 4];
 };
 
 // Shell object were we store all info about shell
 struct shell_info *shell;
 
+extern char **environ;
+
 // Variable to save terminal modes
 struct termios shell_tmodes;
 
-// Gets the job id based of the process'es id
-int get_job_id(int pid) {
-    int i;
+// The prompt's line editor
+struct line_editor editor;
+
+// History shared by every prompt of this shell
+struct history history;
+
+// Execution trace, NULL unless --trace was given
+struct trace_ring *tracer;
+
+// Path of the last command found through a relative $PATH entry
+char relative_command[PATH_BUFSIZE];
+
+// Listings of the directories globbed lately
+struct dir_listing glob_cache[GLOB_CACHE_SIZE];
+unsigned long glob_clock;
+
+// Words of the glob being expanded, the buffers are reused by every glob
+struct glob_results glob_results;
+
+// Hash bucket of a pid in the pid table
+int pid_hash(int pid, int size) {
+    return (unsigned int) pid * 2654435761u % size;
+}
+
+// Doubles the pid table and rehashes every process into it
+void grow_pid_table() {
+    int i, new_size = shell->pid_table_size * 2;
+    struct process **table = (struct process**) calloc(new_size, sizeof(struct process*));
+    struct process *proc, *next;
+
+    if (!table) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < shell->pid_table_size; i++) {
+        for (proc = shell->pid_table[i]; proc != NULL; proc = next) {
+            next = proc->hash_next;
+            proc->hash_next = table[pid_hash(proc->pid, new_size)];
+            table[pid_hash(proc->pid, new_size)] = proc;
+        }
+    }
+
+    free(shell->pid_table);
+    shell->pid_table = table;
+    shell->pid_table_size = new_size;
+}
+
+// Indexes a launched process by its pid so reaping it is O(1)
+void insert_pid(struct process *proc) {
+    int bucket;
+
+    if (shell->nr_pids >= shell->pid_table_size) {
+        grow_pid_table();
+    }
+
+    bucket = pid_hash(proc->pid, shell->pid_table_size);
+    proc->hash_next = shell->pid_table[bucket];
+    shell->pid_table[bucket] = proc;
+    shell->nr_pids++;
+}
+
+// Drops a process from the pid table before it is freed
+void remove_pid(struct process *proc) {
+    struct process **link = &shell->pid_table[pid_hash(proc->pid, shell->pid_table_size)];
+
+    for (; *link != NULL; link = &(*link)->hash_next) {
+        if (*link == proc) {
+            *link = proc->hash_next;
+            shell->nr_pids--;
+            return;
+        }
+    }
+}
+
+// Finds the process with the given pid among the live jobs
+struct process *get_process_by_pid(int pid) {
     struct process *proc;
 
-    for (i = 1; i <= NR_JOBS; i++) {
-        if (shell->jobs[i] != NULL) {
-            for (proc = shell->jobs[i]->root; proc != NULL; proc = proc->next) {
-                if (proc->pid == pid) {
-                    return i;
-                }
-            }
+    for (proc = shell->pid_table[pid_hash(pid, shell->pid_table_size)]; proc != NULL; proc = proc->hash_next) {
+        if (proc->pid == pid) {
+            return proc;
         }
     }
 
-    return -1;
+    return NULL;
+}
+
+// Gets the job id based of the process'es id
+int get_job_id(int pid) {
+    struct process *proc = get_process_by_pid(pid);
+
+    if (proc == NULL) {
+        return -1;
+    }
+
+    return proc->job_id;
 }
 
 struct job* get_job_by_id(int id) {
-    if (id > NR_JOBS) {
+    if (id < 1 || id > shell->max_job_id) {
         return NULL;
     }
 
@@ -122,7 +484,8 @@ void update_cwd_info() {
 
 // Prints the shell prompt
 void display_prompt() {
-    printf("prompt> ");
+    printf(PROMPT);
+    fflush(stdout);
 }
 
 // Handles SIGINT signals
@@ -131,7 +494,7 @@ void sigint_handler(int signal) {
 }
 
 int get_proc_count(int id, int filter) {
-    if (id > NR_JOBS || shell->jobs[id] == NULL) {
+    if (get_job_by_id(id) == NULL) {
         return -1;
     }
 
@@ -148,66 +511,338 @@ int get_proc_count(int id, int filter) {
     return count;
 }
 
+// Takes the smallest free job id off the free list heap
+int pop_free_job_id() {
+    int id = shell->free_ids[0], i = 0, child, tmp;
+
+    shell->free_ids[0] = shell->free_ids[--shell->nr_free_ids];
+    while ((child = 2 * i + 1) < shell->nr_free_ids) {
+        if (child + 1 < shell->nr_free_ids && shell->free_ids[child + 1] < shell->free_ids[child]) {
+            child++;
+        }
+        if (shell->free_ids[i] <= shell->free_ids[child]) {
+            break;
+        }
+        tmp = shell->free_ids[i];
+        shell->free_ids[i] = shell->free_ids[child];
+        shell->free_ids[child] = tmp;
+        i = child;
+    }
+
+    return id;
+}
+
+// Puts the id of a removed job back on the free list heap
+void push_free_job_id(int id) {
+    int i = shell->nr_free_ids++, parent, tmp;
+
+    shell->free_ids[i] = id;
+    while (i > 0 && shell->free_ids[parent = (i - 1) / 2] > shell->free_ids[i]) {
+        tmp = shell->free_ids[i];
+        shell->free_ids[i] = shell->free_ids[parent];
+        shell->free_ids[parent] = tmp;
+        i = parent;
+    }
+}
+
+// Doubles the job table and the free list along with it
+void grow_job_table() {
+    int i, new_size = shell->jobs_size * 2;
+
+    shell->jobs = (struct job**) realloc(shell->jobs, (new_size + 1) * sizeof(struct job*));
+    shell->free_ids = (int*) realloc(shell->free_ids, (new_size + 1) * sizeof(int));
+    if (!shell->jobs || !shell->free_ids) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = shell->jobs_size + 1; i <= new_size; i++) {
+        shell->jobs[i] = NULL;
+    }
+    shell->jobs_size = new_size;
+}
+
+// Reuses the smallest freed id so ids stay dense, otherwise hands out a new one
 int get_next_job_id() {
-    int i;
+    if (shell->nr_free_ids > 0) {
+        return pop_free_job_id();
+    }
 
-    for (i = 1; i <= NR_JOBS; i++) {
-        if (shell->jobs[i] == NULL) {
-            return i;
+    if (shell->max_job_id >= shell->jobs_size) {
+        grow_job_table();
+    }
+
+    return ++shell->max_job_id;
+}
+
+// Hands out size bytes from the arena, adding a block when the current one is full
+void *arena_alloc(struct arena *arena, size_t size) {
+    struct arena_block *block = arena->head;
+    size_t block_size;
+
+    size = (size + 15) & ~(size_t) 15;
+    if (block == NULL || block->used + size > block->size) {
+        block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (struct arena_block*) malloc(sizeof(struct arena_block) + block_size);
+        if (!block) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
         }
+        block->next = arena->head;
+        block->size = block_size;
+        block->used = 0;
+        arena->head = block;
     }
 
-    return -1;
+    block->used += size;
+    return block->data + block->used - size;
+}
+
+// Copies len bytes of a string into the arena
+char *arena_strndup(struct arena *arena, const char *str, size_t len) {
+    char *copy = (char*) arena_alloc(arena, len + 1);
+
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char *arena_strdup(struct arena *arena, const char *str) {
+    return arena_strndup(arena, str, strlen(str));
+}
+
+// Frees every block of the arena at once
+void arena_release(struct arena *arena) {
+    struct arena_block *block, *next;
+
+    for (block = arena->head; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+    arena->head = NULL;
+}
+
+// Frees a job and everything parsed for it. The job itself lives in its
+// arena, so the arena is copied out before it is released
+void free_job(struct job *job) {
+    struct arena arena = job->arena;
+    struct process *proc;
+
+    for (proc = job->root; proc != NULL; proc = proc->next) {
+        if (proc->pid > 0) {
+            remove_pid(proc);
+        }
+    }
+
+    arena_release(&arena);
 }
 
 // Frees the pointers in a job object
 int release_job(int id) {
-    if (id > NR_JOBS || shell->jobs[id] == NULL) {
+    if (get_job_by_id(id) == NULL) {
         return -1;
     }
 
-    struct job *job = shell->jobs[id];
-    struct process *proc, *tmp;
-    for (proc = job->root; proc != NULL; ) {
-        tmp = proc->next;
-        free(proc->command);
-        free(proc->argv);
-        free(proc->input_path);
-        free(proc->output_path);
-        free(proc);
-        proc = tmp;
+    free_job(shell->jobs[id]);
+
+    return 0;
+}
+
+// Writes text as a JSON string
+void write_json_string(FILE *fp, const char *text) {
+    fputc('"', fp);
+    for (; *text != '\0'; text++) {
+        if (*text == '"' || *text == '\\') {
+            fprintf(fp, "\\%c", *text);
+        } else if ((unsigned char) *text < ' ') {
+            fprintf(fp, "\\u%04x", (unsigned char) *text);
+        } else {
+            fputc(*text, fp);
+        }
     }
+    fputc('"', fp);
+}
 
-    free(job->command);
-    free(job);
+// Nanoseconds on CLOCK_MONOTONIC
+uint64_t trace_now() {
+    struct timespec now;
 
-    return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-// Sets satus for process
-int set_process_status(int pid, int status) {
-    int i;
-    struct process *proc;
+uint64_t timespec_ns(struct timespec *ts) {
+    return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
 
-    for (i = 1; i <= NR_JOBS; i++) {
-        if (shell->jobs[i] == NULL) {
+// Queues an event for the writer thread. Only the shell's main thread
+// records events, so the ring has a single producer and a single consumer
+// and needs no lock. A full ring makes the shell yield until the writer
+// catches up rather than lose the event
+void trace_event(char phase, int tid, int job_id, uint64_t ts, uint64_t dur, const char *name) {
+    struct trace_event *event;
+    size_t head;
+
+    if (tracer == NULL) {
+        return;
+    }
+
+    head = atomic_load_explicit(&tracer->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&tracer->tail, memory_order_acquire) == TRACE_RING_SIZE) {
+        sched_yield();
+    }
+
+    event = &tracer->events[head % TRACE_RING_SIZE];
+    event->phase = phase;
+    event->tid = tid;
+    event->job_id = job_id;
+    event->ts = ts;
+    event->dur = dur;
+    strncpy(event->name, name, TRACE_NAME_SIZE - 1);
+    event->name[TRACE_NAME_SIZE - 1] = '\0';
+
+    atomic_store_explicit(&tracer->head, head + 1, memory_order_release);
+}
+
+// Writes one event in the Chrome trace event format, times in microseconds
+// since the trace was opened
+void trace_write_event(struct trace_event *event) {
+    FILE *fp = tracer->fp;
+
+    fprintf(fp, "%s{\"name\":", tracer->written++ ? ",\n" : "");
+    write_json_string(fp, event->name);
+    fprintf(fp, ",\"cat\":\"shell\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+        event->phase, (event->ts - tracer->start) / 1e3, tracer->owner,
+        event->tid ? event->tid : tracer->owner);
+    if (event->phase == 'X') {
+        fprintf(fp, ",\"dur\":%.3f", event->dur / 1e3);
+    } else if (event->phase == 'i') {
+        fprintf(fp, ",\"s\":\"t\"");
+    }
+    if (event->job_id > 0) {
+        fprintf(fp, ",\"args\":{\"job\":%d}", event->job_id);
+    }
+    fprintf(fp, "}");
+}
+
+// Writer thread, drains the ring into the trace file until told to stop
+void *trace_writer(void *arg) {
+    struct timespec idle = { 0, TRACE_IDLE_NS };
+    size_t head, tail;
+    int stop;
+
+    (void) arg;
+    while (1) {
+        stop = atomic_load_explicit(&tracer->stop, memory_order_acquire);
+        head = atomic_load_explicit(&tracer->head, memory_order_acquire);
+        tail = atomic_load_explicit(&tracer->tail, memory_order_relaxed);
+
+        if (tail == head) {
+            if (stop) {
+                break;
+            }
+            fflush(tracer->fp);
+            nanosleep(&idle, NULL);
             continue;
         }
-        for (proc = shell->jobs[i]->root; proc != NULL; proc = proc->next) {
-            if (proc->pid == pid) {
-                proc->status = status;
-                return 0;
-            }
+
+        for (; tail != head; tail++) {
+            trace_write_event(&tracer->events[tail % TRACE_RING_SIZE]);
         }
+        atomic_store_explicit(&tracer->tail, tail, memory_order_release);
     }
 
-    return -1;
+    return NULL;
+}
+
+// Stops the writer once the ring is drained and closes the trace. Forked
+// children inherit the exit handler but not the thread, so they leave the
+// file to the shell
+void trace_close() {
+    if (tracer == NULL || getpid() != tracer->owner) {
+        return;
+    }
+
+    atomic_store_explicit(&tracer->stop, 1, memory_order_release);
+    pthread_join(tracer->writer, NULL);
+    fprintf(tracer->fp, "\n]}\n");
+    fclose(tracer->fp);
+    tracer = NULL;
+}
+
+// Starts recording launches, exits, waits, pipes and job changes to path
+int trace_open(char *path) {
+    FILE *fp = fopen(path, "we");
+
+    if (fp == NULL) {
+        fprintf(stderr, "mysh: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    tracer = (struct trace_ring*) calloc(1, sizeof(struct trace_ring));
+    if (!tracer) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    tracer->fp = fp;
+    tracer->owner = getpid();
+    tracer->start = trace_now();
+    atomic_init(&tracer->head, 0);
+    atomic_init(&tracer->tail, 0);
+    atomic_init(&tracer->stop, 0);
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+    if (pthread_create(&tracer->writer, NULL, trace_writer, NULL) != 0) {
+        fprintf(stderr, "mysh: unable to start the trace writer\n");
+        fclose(fp);
+        free(tracer);
+        tracer = NULL;
+        return -1;
+    }
+    atexit(trace_close);
+
+    return 0;
+}
+
+// Keeps what wait4 reported for a process that exited or was killed
+int set_process_usage(int pid, struct rusage *usage) {
+    struct process *proc = get_process_by_pid(pid);
+
+    if (proc == NULL) {
+        return -1;
+    }
+
+    proc->usage = *usage;
+    clock_gettime(CLOCK_MONOTONIC, &proc->finished);
+    trace_event('E', pid, proc->job_id, timespec_ns(&proc->finished), 0, proc->command);
+    return 0;
+}
+
+// Sets satus for process
+int set_process_status(int pid, int status) {
+    struct process *proc = get_process_by_pid(pid);
+
+    if (proc == NULL) {
+        return -1;
+    }
+
+    proc->status = status;
+    if (status == STATUS_SUSPENDED || status == STATUS_CONTINUED) {
+        trace_event('i', pid, proc->job_id, trace_now(), 0, STATUS_STRING[status]);
+    }
+    return 0;
 }
 
 int wait_for_pid(int pid) {
+    struct rusage usage;
     int status = 0;
 
-    waitpid(pid, &status, WUNTRACED);
+    trace_event('B', 0, 0, trace_now(), 0, "wait");
+    wait4(pid, &status, WUNTRACED, &usage);
+    trace_event('E', 0, 0, trace_now(), 0, "wait");
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        set_process_usage(pid, &usage);
+    }
     if (WIFEXITED(status)) {
         set_process_status(pid, STATUS_DONE);
     } else if (WIFSIGNALED(status)) {
@@ -222,13 +857,14 @@ int wait_for_pid(int pid) {
 
 // Let's us know if job is completed
 int job_completed_check(int id) {
-    if (id > NR_JOBS || shell->jobs[id] == NULL) {
+    if (get_job_by_id(id) == NULL) {
         return 0;
     }
 
     struct process *proc;
     for (proc = shell->jobs[id]->root; proc != NULL; proc = proc->next) {
-        if (proc->status != STATUS_DONE) {
+        if (proc->status != STATUS_DONE && proc->status != STATUS_TERMINATED
+                && proc->status != STATUS_OOM_KILLED) {
             return 0;
         }
     }
@@ -237,7 +873,7 @@ int job_completed_check(int id) {
 }
 
 int print_processes_of_job(int id) {
-    if (id > NR_JOBS || shell->jobs[id] == NULL) {
+    if (get_job_by_id(id) == NULL) {
         return -1;
     }
 
@@ -252,9 +888,101 @@ int print_processes_of_job(int id) {
     return 0;
 }
 
+// Seconds between two CLOCK_MONOTONIC readings
+double elapsed_seconds(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+double timeval_seconds(struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// Wall time of a process so far, or until it finished
+double process_wall_time(struct process *proc) {
+    struct timespec now;
+
+    if (proc->finished.tv_sec == 0 && proc->finished.tv_nsec == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return elapsed_seconds(&proc->started, &now);
+    }
+    return elapsed_seconds(&proc->started, &proc->finished);
+}
+
+// Appends one JSON line per process of a job to the usage log
+void log_job_usage(int id) {
+    struct process *proc;
+
+    for (proc = shell->jobs[id]->root; proc != NULL; proc = proc->next) {
+        if (proc->pid <= 0) {
+            continue;
+        }
+        fprintf(shell->usage_log, "{\"job\":%d,\"pid\":%d,\"command\":", id, proc->pid);
+        write_json_string(shell->usage_log, proc->command);
+        fprintf(shell->usage_log, ",\"status\":\"%s\",\"wall\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+            "\"maxrss_kb\":%ld,\"voluntary_cs\":%ld,\"involuntary_cs\":%ld}\n",
+            STATUS_STRING[proc->status], process_wall_time(proc),
+            timeval_seconds(&proc->usage.ru_utime), timeval_seconds(&proc->usage.ru_stime),
+            proc->usage.ru_maxrss, proc->usage.ru_nvcsw, proc->usage.ru_nivcsw);
+    }
+    fflush(shell->usage_log);
+}
+
+// Reports the times of a job run under the time prefix, the job first and
+// then each stage of its pipeline. Wall time runs from the first stage
+// starting to the last one finishing
+void print_job_time(int id) {
+    struct process *proc, *first = NULL;
+    struct timespec *last = NULL;
+    double user = 0, sys = 0;
+
+    for (proc = shell->jobs[id]->root; proc != NULL; proc = proc->next) {
+        if (proc->pid <= 0) {
+            continue;
+        }
+        if (first == NULL) {
+            first = proc;
+        }
+        if (last == NULL || elapsed_seconds(last, &proc->finished) > 0) {
+            last = &proc->finished;
+        }
+        user += timeval_seconds(&proc->usage.ru_utime);
+        sys += timeval_seconds(&proc->usage.ru_stime);
+    }
+    if (first == NULL) {
+        return;
+    }
+
+    fprintf(stderr, "real\t%.3fs\tuser\t%.3fs\tsys\t%.3fs\t%s\n",
+        elapsed_seconds(&first->started, last), user, sys, shell->jobs[id]->command);
+    if (first->next == NULL) {
+        return;
+    }
+    for (proc = first; proc != NULL; proc = proc->next) {
+        if (proc->pid > 0) {
+            fprintf(stderr, "  real\t%.3fs\tuser\t%.3fs\tsys\t%.3fs\t%s\n",
+                process_wall_time(proc), timeval_seconds(&proc->usage.ru_utime),
+                timeval_seconds(&proc->usage.ru_stime), proc->command);
+        }
+    }
+}
+
+// Displays the job status with the resources each process used, processes
+// still running show their wall time so far
+void print_job_usage(int id) {
+    struct process *proc;
+
+    printf("[%d]\n", id);
+    for (proc = shell->jobs[id]->root; proc != NULL; proc = proc->next) {
+        printf("\t%d\t%s\t%.3fs real\t%.3fs user\t%.3fs sys\t%ld KB\t%ld/%ld cs\t%s\n",
+            proc->pid, STATUS_STRING[proc->status], process_wall_time(proc),
+            timeval_seconds(&proc->usage.ru_utime), timeval_seconds(&proc->usage.ru_stime),
+            proc->usage.ru_maxrss, proc->usage.ru_nvcsw, proc->usage.ru_nivcsw, proc->command);
+    }
+}
+
 // Displays the job status in the command line
 int print_job_status(int id) {
-    if (id > NR_JOBS || shell->jobs[id] == NULL) {
+    if (get_job_by_id(id) == NULL) {
         return -1;
     }
 
@@ -275,18 +1003,23 @@ int print_job_status(int id) {
 }
 
 int wait_for_job(int id) {
-    if (id > NR_JOBS || shell->jobs[id] == NULL) {
+    if (get_job_by_id(id) == NULL) {
         return -1;
     }
 
     int proc_count = get_proc_count(id, PROC_FILTER_REMAINING);
     int wait_pid = -1, wait_count = 0;
     int status = 0;
+    struct rusage usage;
 
+    trace_event('B', 0, id, trace_now(), 0, "wait");
     do {
-        wait_pid = waitpid(-shell->jobs[id]->pgid, &status, WUNTRACED);
+        wait_pid = wait4(-shell->jobs[id]->pgid, &status, WUNTRACED, &usage);
         wait_count++;
 
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            set_process_usage(wait_pid, &usage);
+        }
         if (WIFEXITED(status)) {
             set_process_status(wait_pid, STATUS_DONE);
         } else if (WIFSIGNALED(status)) {
@@ -299,6 +1032,7 @@ int wait_for_job(int id) {
             }
         }
     } while (wait_count < proc_count);
+    trace_event('E', 0, id, trace_now(), 0, "wait");
 
     return status;
 }
@@ -312,51 +1046,735 @@ int insert_job(struct job *job) {
 
     job->id = id;
     shell->jobs[id] = job;
+    trace_event('i', 0, id, trace_now(), 0, "job started");
     return id;
 }
 
+void finish_job_limits(int id);
+
 // Removes job if completed
 int remove_job(int id) {
-    if (id > NR_JOBS || shell->jobs[id] == NULL) {
+    if (get_job_by_id(id) == NULL) {
         return -1;
     }
 
+    finish_job_limits(id);
+    trace_event('i', 0, id, trace_now(), 0, "job removed");
+    if (shell->jobs[id]->mode == BACKGROUND_EXECUTION && !shell->jobs[id]->queued) {
+        shell->nr_background--;
+    }
+    if (shell->jobs[id]->timed) {
+        print_job_time(id);
+    }
+    if (shell->usage_log != NULL) {
+        log_job_usage(id);
+    }
     release_job(id);
     shell->jobs[id] = NULL;
+    push_free_job_id(id);
 
     return 0;
 }
 
-// Let's us know if process is a zombie process
-void check_zombie() {
-    int status, pid;
+void start_queued_jobs();
 
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
-        // Process has exited
-        if (WIFEXITED(status)) {
-            set_process_status(pid, STATUS_DONE);
-        // Process is currently suspended
-        } else if (WIFSTOPPED(status)) {
-            set_process_status(pid, STATUS_SUSPENDED);
-        // Process is still running
-        } else if (WIFCONTINUED(status)) {
-            set_process_status(pid, STATUS_CONTINUED);
-        }
-
-        int job_id = get_job_id(pid);
-        if (job_id > 0 && job_completed_check(job_id)) {
-            print_job_status(job_id);
-            remove_job(job_id);
-        }
+// Records a status wait4 returned for pid and reports the job once it is
+// complete, first being set for the first report of a batch.
+// Returns 1 if the job was reported and removed
+int reap_process(int pid, int status, struct rusage *usage, int first) {
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        set_process_usage(pid, usage);
     }
-}
 
-// Changes the directory of the shell
-int shell_cd(int argc, char** argv) {
-    if (argc == 1) {
-        chdir(shell->pw_dir);
-        update_cwd_info();
-        return 0;
+    // Process has exited
+    if (WIFEXITED(status)) {
+        set_process_status(pid, STATUS_DONE);
+    // Process was killed by a signal
+    } else if (WIFSIGNALED(status)) {
+        set_process_status(pid, STATUS_TERMINATED);
+    // Process is currently suspended
+    } else if (WIFSTOPPED(status)) {
+        set_process_status(pid, STATUS_SUSPENDED);
+    // Process is still running
+    } else if (WIFCONTINUED(status)) {
+        set_process_status(pid, STATUS_CONTINUED);
+    }
+
+    int job_id = get_job_id(pid);
+    if (job_id > 0 && job_completed_check(job_id)) {
+        // The report replaces the prompt line, which is redrawn after it
+        if (first && editor.tty) {
+            printf("\r\033[K");
+        }
+        finish_job_limits(job_id);
+        print_job_status(job_id);
+        remove_job(job_id);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Let's us know if process is a zombie process
+// Returns the number of finished jobs that were reported
+int check_zombie() {
+    int status, pid, reported = 0;
+    struct rusage usage;
+
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        reported += reap_process(pid, status, &usage, reported == 0);
+    }
+    start_queued_jobs();
+
+    return reported;
+}
+
+// Empties the SIGCHLD signalfd and reaps whatever has exited
+int handle_sigchld() {
+    struct signalfd_siginfo info;
+
+    while (read(shell->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+
+    return check_zombie();
+}
+
+// Trigram of a history entry folded into one of the index buckets
+int trigram_bucket(const char *text) {
+    unsigned int h = (unsigned char) text[0] * 65599u * 65599u
+        + (unsigned char) text[1] * 65599u + (unsigned char) text[2];
+    return h % HISTORY_BUCKETS;
+}
+
+// Gets entry id, the mapped log comes first and this session's entries
+// follow it
+const char *history_entry(int id, size_t *len) {
+    if (id < history.nr_mapped) {
+        *len = history.offsets[id + 1] - history.offsets[id] - 1;
+        return history.map + history.offsets[id];
+    }
+    *len = strlen(history.added[id - history.nr_mapped]);
+    return history.added[id - history.nr_mapped];
+}
+
+// Splits the mapped log into entries, done on first use rather than at
+// startup so a long history does not slow the shell down
+void history_load() {
+    size_t pos = 0, size = 0;
+    const char *end;
+
+    if (history.loaded) {
+        return;
+    }
+    history.loaded = 1;
+
+    while (pos < history.map_size) {
+        if (history.nr_mapped + 2 > (int) size) {
+            size = size ? size * 2 : COMMAND_BUFSIZE;
+            history.offsets = realloc(history.offsets, size * sizeof(size_t));
+            if (!history.offsets) {
+                fprintf(stderr, "mysh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        history.offsets[history.nr_mapped++] = pos;
+        end = memchr(history.map + pos, '\n', history.map_size - pos);
+        // A torn last line counts as if its newline was there
+        pos = end != NULL ? (size_t) (end - history.map) + 1 : history.map_size + 1;
+    }
+    if (history.nr_mapped > 0) {
+        history.offsets[history.nr_mapped] = pos;
+    }
+    history.count = history.nr_mapped + history.nr_added;
+}
+
+// Adds entry id to the posting list of every trigram it contains
+void history_index_entry(int id) {
+    struct history_postings *list;
+    const char *text;
+    size_t len, i;
+
+    text = history_entry(id, &len);
+    for (i = 0; i + 3 <= len; i++) {
+        list = &history.buckets[trigram_bucket(text + i)];
+        if (list->count > 0 && list->ids[list->count - 1] == id) {
+            continue;
+        }
+        if (list->count == list->size) {
+            list->size = list->size ? list->size * 2 : 4;
+            list->ids = realloc(list->ids, list->size * sizeof(int));
+            if (!list->ids) {
+                fprintf(stderr, "mysh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        list->ids[list->count++] = id;
+    }
+}
+
+// Returns 1 while there are entries left for the idle loop to index
+int history_index_pending() {
+    return history.buckets != NULL && history.indexed < history.count;
+}
+
+// Indexes the next few entries, called by the event loop whenever the
+// prompt is idle so no keystroke ever waits for the whole index
+void history_index_step() {
+    int end = history.indexed + HISTORY_INDEX_STEP;
+
+    if (end > history.count) {
+        end = history.count;
+    }
+    while (history.indexed < end) {
+        history_index_entry(history.indexed++);
+    }
+}
+
+// Finds the newest entry before id that contains query, or -1, looking at
+// entries not indexed yet one by one
+int history_scan(const char *query, size_t query_len, int before, int first) {
+    const char *text;
+    size_t len;
+    int id;
+
+    for (id = before - 1; id >= first; id--) {
+        text = history_entry(id, &len);
+        if (memmem(text, len, query, query_len) != NULL) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+// Finds the newest entry before id that contains query, or -1. Entries
+// the idle loop has indexed are only looked at if they share the query's
+// rarest trigram, the rest and queries under three bytes are scanned
+int history_search(const char *query, size_t query_len, int before) {
+    struct history_postings *list = NULL, *candidate;
+    const char *text;
+    size_t len, i;
+    int lo, hi, mid, id;
+
+    history_load();
+    if (before > history.count) {
+        before = history.count;
+    }
+
+    // The first search starts the index, the event loop builds it from here
+    if (history.buckets == NULL) {
+        history.buckets = calloc(HISTORY_BUCKETS, sizeof(struct history_postings));
+        if (!history.buckets) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (query_len < 3) {
+        return history_scan(query, query_len, before, 0);
+    }
+    if (before > history.indexed) {
+        id = history_scan(query, query_len, before, history.indexed);
+        if (id >= 0) {
+            return id;
+        }
+        before = history.indexed;
+    }
+
+    for (i = 0; i + 3 <= query_len; i++) {
+        candidate = &history.buckets[trigram_bucket(query + i)];
+        if (list == NULL || candidate->count < list->count) {
+            list = candidate;
+        }
+    }
+
+    // Posting lists are in id order, so start from the last id below before
+    lo = 0;
+    hi = list->count;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (list->ids[mid] < before) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (i = lo; i-- > 0; ) {
+        text = history_entry(list->ids[i], &len);
+        if (memmem(text, len, query, query_len) != NULL) {
+            return list->ids[i];
+        }
+    }
+    return -1;
+}
+
+// Records a command line, appending it to the log under an exclusive lock
+// so concurrent shells never interleave their lines
+void history_add(const char *line) {
+    size_t len = strlen(line);
+    char *copy;
+
+    if (strspn(line, " \t") == len || strchr(line, '\n') != NULL) {
+        return;
+    }
+
+    if (history.fd >= 0) {
+        copy = malloc(len + 1);
+        if (!copy) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(copy, line, len);
+        copy[len] = '\n';
+        flock(history.fd, LOCK_EX);
+        if (write(history.fd, copy, len + 1) < 0) {
+            perror("mysh: history");
+        }
+        flock(history.fd, LOCK_UN);
+        free(copy);
+    }
+
+    if (history.nr_added == history.added_size) {
+        history.added_size = history.added_size ? history.added_size * 2 : TOKEN_BUFSIZE;
+        history.added = realloc(history.added, history.added_size * sizeof(char*));
+        if (!history.added) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    history.added[history.nr_added++] = strdup(line);
+
+    if (history.loaded) {
+        history.count++;
+    }
+}
+
+// Maps the history log, whatever is in it stays untouched until the first
+// search or recall
+void history_open() {
+    char path[PATH_BUFSIZE];
+    struct stat st;
+    int fd;
+
+    memset(&history, 0, sizeof(history));
+    history.fd = -1;
+    if (snprintf(path, sizeof(path), "%s/%s", shell->pw_dir, HISTORY_FILE) >= (int) sizeof(path)) {
+        return;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            history.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (history.map == MAP_FAILED) {
+                history.map = NULL;
+            } else {
+                history.map_size = st.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    history.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
+
+// Grows the edit buffer so it holds at least size bytes
+void editor_reserve(size_t size) {
+    if (size <= editor.size) {
+        return;
+    }
+    while (editor.size < size) {
+        editor.size = editor.size ? editor.size * 2 : COMMAND_BUFSIZE;
+    }
+    editor.buf = realloc(editor.buf, editor.size);
+    if (!editor.buf) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Switches the terminal between raw mode for editing and the modes saved
+// at startup, which is what jobs run with
+void editor_raw_mode(int on) {
+    struct termios raw = shell_tmodes;
+
+    if (!editor.tty) {
+        return;
+    }
+    if (on) {
+        raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(0, TCSADRAIN, &raw);
+    } else {
+        tcsetattr(0, TCSADRAIN, &shell_tmodes);
+    }
+}
+
+// Moves the terminal cursor from the edit position to pos
+void editor_move_to(size_t pos) {
+    if (pos < editor.cursor) {
+        printf("\033[%zuD", editor.cursor - pos);
+    } else if (pos > editor.cursor) {
+        fwrite(editor.buf + editor.cursor, 1, pos - editor.cursor, stdout);
+    }
+    editor.cursor = pos;
+}
+
+// Redraws the prompt and the line being edited from scratch
+void editor_redraw() {
+    size_t cursor = editor.cursor;
+
+    if (!editor.tty) {
+        display_prompt();
+        return;
+    }
+    printf("\r\033[K%s", PROMPT);
+    fwrite(editor.buf, 1, editor.len, stdout);
+    editor.cursor = editor.len;
+    editor_move_to(cursor);
+    fflush(stdout);
+}
+
+// Inserts text at the cursor, only the tail of the line is redrawn
+void editor_insert(const char *text, size_t len) {
+    size_t tail = editor.len - editor.cursor;
+
+    editor_reserve(editor.len + len + 1);
+    memmove(editor.buf + editor.cursor + len, editor.buf + editor.cursor, tail);
+    memcpy(editor.buf + editor.cursor, text, len);
+    editor.len += len;
+
+    fwrite(editor.buf + editor.cursor, 1, len + tail, stdout);
+    editor.cursor = editor.len;
+    editor_move_to(editor.len - tail);
+}
+
+// Removes the bytes between from and to and redraws the tail over them
+void editor_delete(size_t from, size_t to) {
+    size_t tail = editor.len - to;
+
+    if (from >= to) {
+        return;
+    }
+    editor_move_to(from);
+    memmove(editor.buf + from, editor.buf + to, tail);
+    editor.len -= to - from;
+
+    fwrite(editor.buf + from, 1, tail, stdout);
+    printf("\033[K");
+    editor.cursor = editor.len;
+    editor_move_to(from);
+}
+
+// Replaces the line being edited, used when recalling history
+void editor_set_line(const char *text, size_t len) {
+    editor_reserve(len + 1);
+    memcpy(editor.buf, text, len);
+    editor.len = len;
+    editor.cursor = len;
+    editor_redraw();
+}
+
+// Steps through history, the line typed before the first step comes back
+// after the newest entry
+void editor_history(int step) {
+    const char *text;
+    size_t len;
+
+    if (editor.history_pos < 0) {
+        if (step > 0) {
+            return;
+        }
+        history_load();
+        editor.saved = realloc(editor.saved, editor.len + 1);
+        if (!editor.saved) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(editor.saved, editor.buf, editor.len);
+        editor.saved_len = editor.len;
+        editor.history_pos = history.count;
+    }
+
+    if (editor.history_pos + step < 0) {
+        return;
+    }
+    editor.history_pos += step;
+    if (editor.history_pos >= history.count) {
+        editor.history_pos = -1;
+        editor_set_line(editor.saved, editor.saved_len);
+        return;
+    }
+    text = history_entry(editor.history_pos, &len);
+    editor_set_line(text, len);
+}
+
+// Draws the reverse search prompt with the current match
+void editor_search_redraw() {
+    const char *text;
+    size_t len;
+
+    printf("\r\033[K(reverse-i-search)`");
+    fwrite(editor.query, 1, editor.query_len, stdout);
+    printf("': ");
+    if (editor.match >= 0) {
+        text = history_entry(editor.match, &len);
+        fwrite(text, 1, len, stdout);
+    }
+}
+
+// Leaves reverse search, keeping the match as the line being edited
+void editor_search_accept() {
+    const char *text;
+    size_t len;
+
+    editor.searching = 0;
+    if (editor.match >= 0) {
+        text = history_entry(editor.match, &len);
+        editor_set_line(text, len);
+    } else {
+        editor_redraw();
+    }
+}
+
+int editor_key(char c);
+
+// Handles a key during reverse search, returns 1 when the match is run
+int editor_search_key(char c) {
+    int match;
+
+    switch (c) {
+    case 18: // Ctrl-R looks further back
+        if (editor.match >= 0) {
+            match = history_search(editor.query, editor.query_len, editor.match);
+            if (match >= 0) {
+                editor.match = match;
+            }
+        }
+        break;
+    case 7: // Ctrl-G gives up and restores the line
+        editor.searching = 0;
+        editor_redraw();
+        return 0;
+    case 127:
+    case '\b':
+        if (editor.query_len > 0) {
+            editor.query_len--;
+            editor.match = editor.query_len > 0 ? history_search(editor.query, editor.query_len, INT_MAX) : -1;
+        }
+        break;
+    case '\r':
+    case '\n':
+        editor_search_accept();
+        return editor_key('\n');
+    default:
+        if ((unsigned char) c >= ' ') {
+            if (editor.query_len < sizeof(editor.query)) {
+                editor.query[editor.query_len++] = c;
+                match = history_search(editor.query, editor.query_len,
+                    editor.match >= 0 ? editor.match + 1 : INT_MAX);
+                if (match >= 0) {
+                    editor.match = match;
+                }
+            }
+            break;
+        }
+        // Anything else ends the search and is handled as usual
+        editor_search_accept();
+        return editor_key(c);
+    }
+    editor_search_redraw();
+    return 0;
+}
+
+// Handles one key, returns 1 when the line is finished
+int editor_key(char c) {
+    // Arrow keys and friends arrive as ESC [ x, possibly split across reads
+    if (editor.escape == 1) {
+        editor.escape = (c == '[' || c == 'O') ? 2 : 0;
+        return 0;
+    }
+    if (editor.escape == 2) {
+        if (c >= '0' && c <= '9') {
+            return 0;
+        }
+        editor.escape = 0;
+        switch (c) {
+        case 'A':
+            editor_history(-1);
+            break;
+        case 'B':
+            editor_history(1);
+            break;
+        case 'C':
+            if (editor.cursor < editor.len) {
+                editor_move_to(editor.cursor + 1);
+            }
+            break;
+        case 'D':
+            if (editor.cursor > 0) {
+                editor_move_to(editor.cursor - 1);
+            }
+            break;
+        case 'H':
+            editor_move_to(0);
+            break;
+        case 'F':
+            editor_move_to(editor.len);
+            break;
+        case '~':
+            editor_delete(editor.cursor, editor.cursor < editor.len ? editor.cursor + 1 : editor.cursor);
+            break;
+        }
+        return 0;
+    }
+
+    switch (c) {
+    case '\r':
+    case '\n':
+        editor_move_to(editor.len);
+        printf("\n");
+        return 1;
+    case 27:
+        editor.escape = 1;
+        break;
+    case 127:
+    case '\b':
+        if (editor.cursor > 0) {
+            editor_delete(editor.cursor - 1, editor.cursor);
+        }
+        break;
+    case 1: // Ctrl-A
+        editor_move_to(0);
+        break;
+    case 5: // Ctrl-E
+        editor_move_to(editor.len);
+        break;
+    case 11: // Ctrl-K
+        editor_delete(editor.cursor, editor.len);
+        break;
+    case 21: // Ctrl-U
+        editor_delete(0, editor.cursor);
+        break;
+    case 12: // Ctrl-L
+        printf("\033[H\033[2J");
+        editor_redraw();
+        break;
+    case 14: // Ctrl-N
+        editor_history(1);
+        break;
+    case 16: // Ctrl-P
+        editor_history(-1);
+        break;
+    case 18: // Ctrl-R
+        editor.searching = 1;
+        editor.query_len = 0;
+        editor.match = -1;
+        editor_search_redraw();
+        break;
+    }
+    return 0;
+}
+
+// Runs the keys of the input buffer through the editor, printable runs are
+// inserted in one go so a paste costs one redraw. Returns 1 when the line
+// is finished, the rest of the input is kept for the next line
+int editor_feed() {
+    size_t run;
+
+    while (editor.input_pos < editor.input_len) {
+        if (editor.searching) {
+            if (editor_search_key(editor.input[editor.input_pos++])) {
+                return 1;
+            }
+            continue;
+        }
+
+        run = 0;
+        while (editor.escape == 0 && editor.input_pos + run < editor.input_len
+                && (unsigned char) editor.input[editor.input_pos + run] >= ' '
+                && editor.input[editor.input_pos + run] != 127) {
+            run++;
+        }
+        if (run > 0) {
+            editor_insert(editor.input + editor.input_pos, run);
+            editor.input_pos += run;
+            continue;
+        }
+
+        // Ctrl-D deletes under the cursor, on an empty line it is end of file
+        if (editor.input[editor.input_pos] == 4 && editor.escape == 0) {
+            editor.input_pos++;
+            if (editor.len == 0) {
+                editor.eof = 1;
+                return 1;
+            }
+            editor_delete(editor.cursor, editor.cursor < editor.len ? editor.cursor + 1 : editor.cursor);
+            continue;
+        }
+
+        if (editor_key(editor.input[editor.input_pos++])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Takes input up to the next newline as is, used when stdin is not a terminal
+int editor_feed_plain() {
+    char *start = editor.input + editor.input_pos;
+    char *end = memchr(start, '\n', editor.input_len - editor.input_pos);
+    size_t len = end != NULL ? (size_t) (end - start) : editor.input_len - editor.input_pos;
+
+    editor_reserve(editor.len + len + 1);
+    memcpy(editor.buf + editor.len, start, len);
+    editor.len += len;
+    editor.input_pos += len + (end != NULL);
+
+    return end != NULL;
+}
+
+// Event loop run while the prompt is up, children are reaped the moment
+// they exit and the line being edited is redrawn under anything they
+// printed. Returns -1 if a signal interrupted the wait
+int wait_for_input() {
+    struct epoll_event events[2];
+    int i, count;
+
+    if (shell->epoll_fd < 0) {
+        handle_sigchld();
+        return 0;
+    }
+
+    while (1) {
+        // Idle time goes to the history index until it is complete
+        count = epoll_wait(shell->epoll_fd, events, 2, history_index_pending() ? 0 : -1);
+        if (count < 0) {
+            return errno == EINTR ? -1 : 0;
+        }
+        if (count == 0) {
+            history_index_step();
+            continue;
+        }
+
+        for (i = 0; i < count; i++) {
+            if (events[i].data.fd == shell->signal_fd) {
+                if (handle_sigchld() > 0) {
+                    editor_redraw();
+                }
+            } else {
+                return 0;
+            }
+        }
+    }
+}
+
+// Changes the directory of the shell
+int shell_cd(int argc, char** argv) {
+    if (argc == 1) {
+        chdir(shell->pw_dir);
+        update_cwd_info();
+        return 0;
     }
 
     if (chdir(argv[1]) == 0) {
@@ -368,365 +1786,2169 @@ int shell_cd(int argc, char** argv) {
     }
 }
 
-// Quits the shell
-int shell_quit() {
-    exit(0);
+// Quits the shell
+int shell_quit() {
+    exit(0);
+}
+
+// Bucket of a command name in the command table
+int command_hash(char *name) {
+    unsigned int hash = 5381;
+
+    while (*name != '\0') {
+        hash = hash * 33 + (unsigned char) *name++;
+    }
+
+    return hash % COMMAND_TABLE_SIZE;
+}
+
+// Forgets every cached command path
+void clear_command_table() {
+    int i;
+    struct command_path *entry, *next;
+
+    for (i = 0; i < COMMAND_TABLE_SIZE; i++) {
+        for (entry = shell->command_table[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+        shell->command_table[i] = NULL;
+    }
+}
+
+// Drops one command from the cache, used when its cached path stops working
+void forget_command(char *name) {
+    struct command_path **link = &shell->command_table[command_hash(name)], *entry;
+
+    for (; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) {
+            entry = *link;
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+    }
+}
+
+// Resolves a command to an absolute path, walking $PATH only on a cache miss.
+// The cache is thrown away whenever $PATH differs from the one it was filled from
+char *lookup_command(char *name) {
+    char *path = getenv("PATH"), *dir, *end;
+    char candidate[PATH_BUFSIZE];
+    struct command_path *entry;
+    struct stat st;
+    int bucket, dir_len;
+
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    if (path == NULL) {
+        path = DEFAULT_PATH;
+    }
+    if (shell->hashed_path == NULL || strcmp(shell->hashed_path, path) != 0) {
+        clear_command_table();
+        free(shell->hashed_path);
+        shell->hashed_path = strdup(path);
+        if (!shell->hashed_path) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    bucket = command_hash(name);
+    for (entry = shell->command_table[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    for (dir = path; ; dir = end + 1) {
+        end = strchr(dir, ':');
+        dir_len = end != NULL ? end - dir : (int) strlen(dir);
+
+        // An empty entry in $PATH means the current directory
+        if (dir_len == 0) {
+            snprintf(candidate, sizeof(candidate), "./%s", name);
+        } else {
+            snprintf(candidate, sizeof(candidate), "%.*s/%s", dir_len, dir, name);
+        }
+
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            // A relative entry depends on the current directory, so it
+            // is not cached and is only good until the next lookup
+            if (candidate[0] != '/') {
+                memcpy(relative_command, candidate, sizeof(candidate));
+                return relative_command;
+            }
+            entry = (struct command_path*) malloc(sizeof(struct command_path));
+            if (!entry) {
+                fprintf(stderr, "mysh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            entry->name = strdup(name);
+            entry->path = strdup(candidate);
+            if (!entry->name || !entry->path) {
+                fprintf(stderr, "mysh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            entry->hits = 1;
+            entry->next = shell->command_table[bucket];
+            shell->command_table[bucket] = entry;
+            return entry->path;
+        }
+
+        if (end == NULL) {
+            return NULL;
+        }
+    }
+}
+
+// Lists the cached commands, -r empties the cache and names are looked up
+int shell_hash(int argc, char **argv) {
+    int i;
+    struct command_path *entry;
+
+    if (argc == 1) {
+        printf("hits\tcommand\n");
+        for (i = 0; i < COMMAND_TABLE_SIZE; i++) {
+            for (entry = shell->command_table[i]; entry != NULL; entry = entry->next) {
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+        return 0;
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            clear_command_table();
+        } else if (lookup_command(argv[i]) == NULL) {
+            printf("mysh: hash: %s: not found\n", argv[i]);
+        }
+    }
+
+    return 0;
+}
+
+// Turns the zero-copy pipeline mode on or off, or sets its pipe size.
+// Sizes take an optional K or M suffix, the kernel rounds them up to pages
+int shell_zerocopy(int argc, char **argv) {
+    char *end;
+    long size;
+
+    if (argc == 1) {
+        if (shell->pipe_size > 0) {
+            printf("zerocopy on, pipe size %d\n", shell->pipe_size);
+        } else {
+            printf("zerocopy off\n");
+        }
+        return 0;
+    }
+
+    if (strcmp(argv[1], "off") == 0) {
+        shell->pipe_size = 0;
+    } else if (strcmp(argv[1], "on") == 0) {
+        shell->pipe_size = ZEROCOPY_PIPE_SIZE;
+    } else {
+        size = strtol(argv[1], &end, 10);
+        if (*end == 'K' || *end == 'k') {
+            size *= 1024;
+            end++;
+        } else if (*end == 'M' || *end == 'm') {
+            size *= 1024 * 1024;
+            end++;
+        }
+        if (*end != '\0' || size <= 0 || size > INT_MAX) {
+            printf("mysh: zerocopy: expected on, off or a pipe size\n");
+            return 0;
+        }
+        shell->pipe_size = size;
+    }
+
+    return 0;
+}
+
+// Reads a size like 512M, K, M and G are powers of 1024
+int parse_size(const char *text, long long *size) {
+    char *end;
+    double value = strtod(text, &end);
+
+    switch (*end) {
+    case 'k':
+    case 'K':
+        value *= 1024;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        value *= 1024 * 1024;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        value *= 1024.0 * 1024 * 1024;
+        end++;
+        break;
+    }
+    if (end == text || *end != '\0' || value < 1) {
+        return -1;
+    }
+
+    *size = (long long) value;
+    return 0;
+}
+
+// Reads one mem=SIZE or cpu=CPUS setting into limits
+int parse_limit(const char *spec, struct job_limits *limits) {
+    char *end;
+
+    if (strncmp(spec, "mem=", 4) == 0 && parse_size(spec + 4, &limits->mem) == 0) {
+        return 0;
+    }
+    if (strncmp(spec, "cpu=", 4) == 0) {
+        limits->cpus = strtod(spec + 4, &end);
+        if (end != spec + 4 && *end == '\0' && limits->cpus > 0) {
+            return 0;
+        }
+    }
+
+    printf("mysh: limit: expected mem=SIZE or cpu=CPUS, got %s\n", spec);
+    return -1;
+}
+
+int limits_active(struct job_limits *limits) {
+    return limits->mem > 0 || limits->cpus > 0;
+}
+
+// Shows or sets the limits every job gets unless it has its own,
+// limit off goes back to none
+int shell_limit(int argc, char **argv) {
+    struct job_limits limits = { 0, 0 };
+    int i;
+
+    if (argc == 1) {
+        if (!limits_active(&shell->default_limits)) {
+            printf("no limits\n");
+        }
+        if (shell->default_limits.mem > 0) {
+            printf("mem=%lld\n", shell->default_limits.mem);
+        }
+        if (shell->default_limits.cpus > 0) {
+            printf("cpu=%g\n", shell->default_limits.cpus);
+        }
+        return 0;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "off") == 0) {
+        shell->default_limits = limits;
+        return 0;
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (parse_limit(argv[i], &limits) < 0) {
+            return 0;
+        }
+    }
+    shell->default_limits = limits;
+
+    return 0;
+}
+
+// Writes text to a cgroup control file
+int write_control(const char *dir, const char *file, const char *text) {
+    char path[PATH_BUFSIZE];
+    int fd, result;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    result = write(fd, text, strlen(text)) == (ssize_t) strlen(text) ? 0 : -1;
+    close(fd);
+
+    return result;
+}
+
+// Gets the number after key in a flat keyed cgroup file like memory.events,
+// 0 if it is not there
+long long read_control(const char *dir, const char *file, const char *key) {
+    char path[PATH_BUFSIZE], name[TOKEN_BUFSIZE];
+    long long value, found = 0;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    if ((fp = fopen(path, "re")) == NULL) {
+        return 0;
+    }
+    while (fscanf(fp, "%63s %lld", name, &value) == 2) {
+        if (strcmp(name, key) == 0) {
+            found = value;
+            break;
+        }
+    }
+    fclose(fp);
+
+    return found;
+}
+
+// Removes the shell's cgroup on the way out, the job leaves are gone by then
+void cgroup_cleanup() {
+    if (shell->cgroup_parent != NULL && getpid() == shell->cgroup_owner) {
+        rmdir(shell->cgroup_parent);
+    }
+}
+
+// Creates a cgroup for the shell's jobs under the shell's own cgroup v2
+// directory, with the memory and cpu controllers on for its leaves.
+// Returns -1 where that is not possible and setrlimit has to do
+int cgroup_init() {
+    char line[PATH_BUFSIZE * 2], mount[PATH_BUFSIZE] = "", own[PATH_BUFSIZE * 2] = "";
+    char base[PATH_BUFSIZE * 4], parent[PATH_BUFSIZE * 4], controllers[TOKEN_BUFSIZE] = "";
+    FILE *fp;
+    int fd;
+    ssize_t n;
+
+    if (shell->cgroup_state != 0) {
+        return shell->cgroup_state > 0 ? 0 : -1;
+    }
+    shell->cgroup_state = -1;
+
+    // Where the unified hierarchy is mounted and where the shell sits in it
+    if ((fp = fopen("/proc/self/mountinfo", "re")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (strstr(line, " - cgroup2 ") != NULL) {
+                sscanf(line, "%*s %*s %*s %*s %1023s", mount);
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    if ((fp = fopen("/proc/self/cgroup", "re")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                snprintf(own, sizeof(own), "%s", line + 3);
+            }
+        }
+        fclose(fp);
+    }
+    if (mount[0] == '\0' || own[0] == '\0') {
+        return -1;
+    }
+
+    snprintf(base, sizeof(base), "%s%s", mount, strcmp(own, "/") == 0 ? "" : own);
+    if (snprintf(parent, sizeof(parent), "%s/mysh.%d", base, getpid()) >= (int) sizeof(parent)) {
+        return -1;
+    }
+    write_control(base, "cgroup.subtree_control", "+memory +cpu");
+    if (mkdir(parent, 0755) < 0) {
+        return -1;
+    }
+
+    if (snprintf(base, sizeof(base), "%s/cgroup.controllers", parent) < (int) sizeof(base)
+            && (fd = open(base, O_RDONLY | O_CLOEXEC)) >= 0) {
+        n = read(fd, controllers, sizeof(controllers) - 1);
+        controllers[n > 0 ? n : 0] = '\0';
+        close(fd);
+    }
+    if (strstr(controllers, "memory") == NULL || strstr(controllers, "cpu") == NULL
+            || write_control(parent, "cgroup.subtree_control", "+memory +cpu") < 0) {
+        rmdir(parent);
+        return -1;
+    }
+
+    shell->cgroup_parent = strdup(parent);
+    shell->cgroup_owner = getpid();
+    shell->cgroup_state = 1;
+    atexit(cgroup_cleanup);
+
+    return 0;
+}
+
+// Sets up the limits of a job about to launch, a cgroup leaf of its own
+// when cgroup v2 is usable. Jobs without a limit prefix get the defaults
+void prepare_job_limits(struct job *job) {
+    char path[PATH_BUFSIZE * 4], value[TOKEN_BUFSIZE];
+
+    if (!job->has_limits) {
+        job->limits = shell->default_limits;
+    }
+    if (!limits_active(&job->limits) || cgroup_init() < 0) {
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/job%d", shell->cgroup_parent, ++shell->cgroup_seq);
+    if (mkdir(path, 0755) < 0) {
+        return;
+    }
+    if (job->limits.mem > 0) {
+        snprintf(value, sizeof(value), "%lld", job->limits.mem);
+        write_control(path, "memory.max", value);
+        write_control(path, "memory.swap.max", "0");
+        // The whole job goes when one of its processes is OOM-killed
+        write_control(path, "memory.oom.group", "1");
+    }
+    if (job->limits.cpus > 0) {
+        snprintf(value, sizeof(value), "%lld %d",
+            (long long) (job->limits.cpus * CGROUP_CPU_PERIOD), CGROUP_CPU_PERIOD);
+        write_control(path, "cpu.max", value);
+    }
+    job->cgroup = arena_strdup(&job->arena, path);
+}
+
+// Puts a process under its job's limits, pid 0 being the caller. Without a
+// cgroup memory is capped with RLIMIT_AS and cpu by pinning to as many CPUs
+void apply_job_limits(struct job *job, pid_t pid) {
+    struct rlimit rlim;
+    cpu_set_t allowed, pinned;
+    char text[TOKEN_BUFSIZE];
+    int cpu, count;
+
+    if (!limits_active(&job->limits)) {
+        return;
+    }
+    if (job->cgroup != NULL) {
+        snprintf(text, sizeof(text), "%d", pid);
+        if (write_control(job->cgroup, "cgroup.procs", text) == 0) {
+            return;
+        }
+    }
+
+    if (job->limits.mem > 0) {
+        rlim.rlim_cur = rlim.rlim_max = job->limits.mem;
+        prlimit(pid, RLIMIT_AS, &rlim, NULL);
+    }
+    if (job->limits.cpus > 0 && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        CPU_ZERO(&pinned);
+        count = (int) (job->limits.cpus + 0.999);
+        for (cpu = 0; cpu < CPU_SETSIZE && count > 0; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                CPU_SET(cpu, &pinned);
+                count--;
+            }
+        }
+        sched_setaffinity(pid, sizeof(pinned), &pinned);
+    }
+}
+
+// Collects what the limits did to a finished job and removes its cgroup.
+// Processes the OOM killer took are marked as such and throttling is
+// reported next to the job
+void finish_job_limits(int id) {
+    struct job *job = shell->jobs[id];
+    struct process *proc;
+    long long oom_kills, throttled;
+
+    if (job->cgroup == NULL) {
+        return;
+    }
+
+    oom_kills = read_control(job->cgroup, "memory.events", "oom_kill");
+    throttled = read_control(job->cgroup, "cpu.stat", "throttled_usec");
+    if (oom_kills > 0) {
+        for (proc = job->root; proc != NULL; proc = proc->next) {
+            if (proc->status == STATUS_TERMINATED) {
+                proc->status = STATUS_OOM_KILLED;
+            }
+        }
+        if (job->mode == FOREGROUND_EXECUTION) {
+            fprintf(stderr, "mysh: [%d] oom-killed: %s\n", id, job->command);
+        }
+    }
+    if (throttled > 0) {
+        job->throttled_usec = throttled;
+        fprintf(stderr, "mysh: [%d] cpu throttled for %.3fs: %s\n", id, throttled / 1e6, job->command);
+    }
+
+    rmdir(job->cgroup);
+    job->cgroup = NULL;
+}
+
+// Lists the jobs, -l adds the time and memory each process used and
+// -d FILE appends that as JSON lines to FILE whenever a job goes away
+int shell_jobs(int argc, char **argv) {
+    int i, usage = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0) {
+            usage = 1;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            if (shell->usage_log != NULL) {
+                fclose(shell->usage_log);
+                shell->usage_log = NULL;
+            }
+            if (i + 1 < argc) {
+                shell->usage_log = fopen(argv[++i], "ae");
+                if (shell->usage_log == NULL) {
+                    printf("mysh: jobs: %s: %s\n", argv[i], strerror(errno));
+                }
+            }
+            return 0;
+        } else {
+            printf("mysh: jobs: usage: jobs [-l] [-d [file]]\n");
+            return 0;
+        }
+    }
+
+    for (i = 1; i <= shell->max_job_id; i++) {
+        if (shell->jobs[i] == NULL) {
+            continue;
+        }
+        if (usage) {
+            print_job_usage(i);
+        } else {
+            print_job_status(i);
+        }
+    }
+
+    return 0;
+}
+
+// Sets how many background jobs may run at once, further jobs started
+// with & wait in a queue. 0 lifts the limit
+int shell_jobmax(int argc, char **argv) {
+    char *end;
+    long max;
+
+    if (argc == 1) {
+        if (shell->max_background == 0) {
+            printf("unlimited\n");
+        } else {
+            printf("%d\n", shell->max_background);
+        }
+        return 0;
+    }
+
+    max = strtol(argv[1], &end, 10);
+    if (argc > 2 || *end != '\0' || end == argv[1] || max < 0 || max > INT_MAX) {
+        printf("mysh: jobmax: usage: jobmax [count]\n");
+        return 0;
+    }
+    shell->max_background = (int) max;
+    start_queued_jobs();
+
+    return 0;
+}
+
+// Tells whether a started job has nothing left running, only stopped
+// processes. Waiting on it would block until someone continues it
+int job_stopped(struct job *job) {
+    struct process *proc;
+    int stopped = 0;
+
+    if (job->queued) {
+        return 0;
+    }
+    for (proc = job->root; proc != NULL; proc = proc->next) {
+        if (proc->status == STATUS_RUNNING || proc->status == STATUS_CONTINUED) {
+            return 0;
+        }
+        stopped |= proc->status == STATUS_SUSPENDED;
+    }
+    return stopped;
+}
+
+// Jobs of ids that are still in the job table and not stopped, every
+// such job without ids
+int count_waited_jobs(int *ids, int nr_ids) {
+    struct job *job;
+    int i, count = 0;
+
+    if (nr_ids == 0) {
+        for (i = 1; i <= shell->max_job_id; i++) {
+            count += shell->jobs[i] != NULL && !job_stopped(shell->jobs[i]);
+        }
+        return count;
+    }
+    for (i = 0; i < nr_ids; i++) {
+        job = get_job_by_id(ids[i]);
+        count += job != NULL && !job_stopped(job);
+    }
+    return count;
+}
+
+// Tells whether any child can still change state without the user
+// continuing a stopped job, queued jobs only start once one does
+int jobs_running() {
+    int i;
+
+    for (i = 1; i <= shell->max_job_id; i++) {
+        if (shell->jobs[i] != NULL && !shell->jobs[i]->queued && !job_stopped(shell->jobs[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Waits until the jobs of ids, or all jobs without ids, are finished or
+// stopped, or with any set until one of them is. Children are reaped in
+// whatever order they exit, queued jobs starting as slots free up. Ctrl-C
+// gives the prompt back and leaves the jobs running
+void wait_for_jobs(int *ids, int nr_ids, int any) {
+    int pending = count_waited_jobs(ids, nr_ids), first = 1, status, pid, left;
+    struct rusage usage;
+
+    trace_event('B', 0, 0, trace_now(), 0, "wait");
+    while ((left = count_waited_jobs(ids, nr_ids)) > 0 && (!any || left == pending) && jobs_running()) {
+        // SIGCHLD goes to the signalfd, so only SIGINT interrupts this
+        pid = wait4(-1, &status, WUNTRACED | WCONTINUED, &usage);
+        if (pid < 0) {
+            break;
+        }
+        if (reap_process(pid, status, &usage, first)) {
+            first = 0;
+        }
+        start_queued_jobs();
+    }
+    trace_event('E', 0, 0, trace_now(), 0, "wait");
+}
+
+// Waits for the listed jobs, or all of them, to finish. With -n it
+// returns once any one of them has finished
+int shell_wait(int argc, char **argv) {
+    int *ids = (int*) malloc(argc * sizeof(int));
+    int nr_ids = 0, any = 0, i;
+    char *end;
+
+    if (!ids) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0) {
+            any = 1;
+            continue;
+        }
+        ids[nr_ids] = (int) strtol(argv[i][0] == '%' ? argv[i] + 1 : argv[i], &end, 10);
+        if (*end != '\0' || get_job_by_id(ids[nr_ids]) == NULL) {
+            printf("mysh: wait: %s: no such job\n", argv[i]);
+            continue;
+        }
+        nr_ids++;
+    }
+    if (nr_ids > 0 || argc == 1 + any) {
+        wait_for_jobs(ids, nr_ids, any);
+    }
+    free(ids);
+
+    return 0;
+}
+
+// Waits for every job, or with names for the jobs started in those
+// groups. Other jobs keep running and are reaped as they finish
+int shell_barrier(int argc, char **argv) {
+    int *ids, nr_ids = 0, i, j;
+
+    if (argc == 1) {
+        wait_for_jobs(NULL, 0, 0);
+        return 0;
+    }
+
+    ids = (int*) malloc((shell->max_job_id + 1) * sizeof(int));
+    if (!ids) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 1; i <= shell->max_job_id; i++) {
+        if (shell->jobs[i] == NULL || shell->jobs[i]->group == NULL) {
+            continue;
+        }
+        for (j = 1; j < argc; j++) {
+            if (strcmp(shell->jobs[i]->group, argv[j]) == 0) {
+                ids[nr_ids++] = i;
+                break;
+            }
+        }
+    }
+    if (nr_ids > 0) {
+        wait_for_jobs(ids, nr_ids, 0);
+    }
+    free(ids);
+
+    return 0;
+}
+
+// group NAME { starts tagging the jobs launched with NAME until the
+// closing }, group alone lists the groups that still have jobs
+int shell_group(int argc, char **argv) {
+    int i, j, count;
+
+    if (argc == 1) {
+        for (i = 1; i <= shell->max_job_id; i++) {
+            if (shell->jobs[i] == NULL || shell->jobs[i]->group == NULL) {
+                continue;
+            }
+            // Each group is listed at its first job
+            for (j = 1; j < i; j++) {
+                if (shell->jobs[j] != NULL && shell->jobs[j]->group != NULL
+                        && strcmp(shell->jobs[j]->group, shell->jobs[i]->group) == 0) {
+                    break;
+                }
+            }
+            if (j < i) {
+                continue;
+            }
+            for (count = 0, j = i; j <= shell->max_job_id; j++) {
+                count += shell->jobs[j] != NULL && shell->jobs[j]->group != NULL
+                    && strcmp(shell->jobs[j]->group, shell->jobs[i]->group) == 0;
+            }
+            printf("%s\t%d\n", shell->jobs[i]->group, count);
+        }
+        return 0;
+    }
+
+    if (argc != 3 || strcmp(argv[2], "{") != 0) {
+        printf("mysh: group: usage: group NAME {\n");
+        return 0;
+    }
+    if (shell->group != NULL) {
+        printf("mysh: group: already in group %s\n", shell->group);
+        return 0;
+    }
+    shell->group = strdup(argv[1]);
+    if (!shell->group) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
+
+// Closes the group opened by group NAME {
+int shell_group_end() {
+    if (shell->group == NULL) {
+        printf("mysh: syntax error near unexpected token `}'\n");
+        return 0;
+    }
+    free(shell->group);
+    shell->group = NULL;
+
+    return 0;
+}
+
+// Checks to see if commands are builtin
+int get_command_type(char *command) {
+    if (strcmp(command, "quit") == 0) {
+        return COMMAND_QUIT;
+    } else if (strcmp(command, "cd") == 0) {
+        return COMMAND_CD;
+    } else if (strcmp(command, "barrier") == 0) {
+        return COMMAND_BARRIER;
+    } else if (strcmp(command, "hash") == 0) {
+        return COMMAND_HASH;
+    } else if (strcmp(command, "zerocopy") == 0) {
+        return COMMAND_ZEROCOPY;
+    } else if (strcmp(command, "jobs") == 0) {
+        return COMMAND_JOBS;
+    } else if (strcmp(command, "limit") == 0) {
+        return COMMAND_LIMIT;
+    } else if (strcmp(command, "jobmax") == 0) {
+        return COMMAND_JOBMAX;
+    } else if (strcmp(command, "wait") == 0) {
+        return COMMAND_WAIT;
+    } else if (strcmp(command, "group") == 0) {
+        return COMMAND_GROUP;
+    } else if (strcmp(command, "}") == 0) {
+        return COMMAND_GROUP_END;
+    } else {
+        return COMMAND_EXTERNAL;
+    }
+}
+
+int execute_builtin_command(struct process *proc) {
+    int status = 1;
+
+    switch (proc->type) {
+        case COMMAND_QUIT:
+            shell_quit();
+            break;
+        case COMMAND_CD:
+            shell_cd(proc->argc, proc->argv);
+            break;
+        case COMMAND_BARRIER:
+            shell_barrier(proc->argc, proc->argv);
+            break;
+        case COMMAND_HASH:
+            shell_hash(proc->argc, proc->argv);
+            break;
+        case COMMAND_ZEROCOPY:
+            shell_zerocopy(proc->argc, proc->argv);
+            break;
+        case COMMAND_JOBS:
+            shell_jobs(proc->argc, proc->argv);
+            break;
+        case COMMAND_LIMIT:
+            shell_limit(proc->argc, proc->argv);
+            break;
+        case COMMAND_JOBMAX:
+            shell_jobmax(proc->argc, proc->argv);
+            break;
+        case COMMAND_WAIT:
+            shell_wait(proc->argc, proc->argv);
+            break;
+        case COMMAND_GROUP:
+            shell_group(proc->argc, proc->argv);
+            break;
+        case COMMAND_GROUP_END:
+            shell_group_end();
+            break;
+        default:
+            status = 0;
+            break;
+    }
+
+    return status;
+}
+
+// Starts an external command with posix_spawn instead of fork, glibc does it
+// with clone(CLONE_VM|CLONE_VFORK) so the shell's memory is never copied.
+// Process group, signal reset and stdio redirection go through spawn
+// attributes and file actions. Returns the child pid or -1
+pid_t spawn_process(struct job *job, struct process *proc, int in_fd, int out_fd) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t default_signals, mask;
+    pid_t childpid;
+    char *path;
+    int error;
+
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGINT);
+    sigaddset(&default_signals, SIGQUIT);
+    sigaddset(&default_signals, SIGTSTP);
+    sigaddset(&default_signals, SIGTTIN);
+    sigaddset(&default_signals, SIGTTOU);
+    sigaddset(&default_signals, SIGCHLD);
+    sigemptyset(&mask);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, job->pgid > 0 ? job->pgid : 0);
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    posix_spawnattr_setsigmask(&attr, &mask);
+
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != 0) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, 0);
+        posix_spawn_file_actions_addclose(&actions, in_fd);
+    }
+    if (out_fd != 1) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, 1);
+        posix_spawn_file_actions_addclose(&actions, out_fd);
+    }
+    if (proc->error_path != NULL) {
+        posix_spawn_file_actions_addopen(&actions, 2, proc->error_path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    }
+
+    // A cached path that has gone away is forgotten and looked up again
+    error = ENOENT;
+    if ((path = lookup_command(proc->argv[0])) != NULL) {
+        error = posix_spawn(&childpid, path, &actions, &attr, proc->argv, environ);
+        if (error == ENOENT && path != proc->argv[0]) {
+            forget_command(proc->argv[0]);
+            if ((path = lookup_command(proc->argv[0])) != NULL) {
+                error = posix_spawn(&childpid, path, &actions, &attr, proc->argv, environ);
+            }
+        }
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    return error == 0 ? childpid : -1;
+}
+
+// Starts an external command of a job with limits. The child is created
+// inside the job's cgroup with clone3(CLONE_INTO_CGROUP), or failing that
+// forked and put under the limits by apply_job_limits, either way before
+// exec so nothing the command does escapes them. posix_spawn has no step
+// for that. Returns the child pid or -1 if it could not be created
+pid_t spawn_limited(struct job *job, struct process *proc, int in_fd, int out_fd) {
+    struct clone_args args;
+    sigset_t mask;
+    pid_t childpid = -1;
+    char *path = lookup_command(proc->argv[0]);
+    int cgroup_fd = -1, fd;
+
+    // A cached path that has gone away is forgotten and looked up again
+    if (path != NULL && path != proc->argv[0] && access(path, X_OK) < 0) {
+        forget_command(proc->argv[0]);
+        path = lookup_command(proc->argv[0]);
+    }
+
+    if (job->cgroup != NULL && (cgroup_fd = open(job->cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = cgroup_fd;
+        childpid = syscall(SYS_clone3, &args, sizeof(args));
+    }
+    // Kernels before 5.7 have no CLONE_INTO_CGROUP
+    if (childpid < 0) {
+        if (cgroup_fd >= 0) {
+            close(cgroup_fd);
+            cgroup_fd = -1;
+        }
+        childpid = fork();
+    }
+
+    if (childpid != 0) {
+        if (cgroup_fd >= 0) {
+            close(cgroup_fd);
+        }
+        if (childpid > 0) {
+            setpgid(childpid, job->pgid > 0 ? job->pgid : childpid);
+        }
+        return childpid;
+    }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    setpgid(0, job->pgid > 0 ? job->pgid : 0);
+    if (cgroup_fd < 0) {
+        apply_job_limits(job, 0);
+    }
+
+    if (in_fd != 0) {
+        dup2(in_fd, 0);
+        close(in_fd);
+    }
+    if (out_fd != 1) {
+        dup2(out_fd, 1);
+        close(out_fd);
+    }
+    if (proc->error_path != NULL && (fd = open(proc->error_path, O_CREAT | O_WRONLY | O_TRUNC, 0644)) >= 0) {
+        dup2(fd, 2);
+        close(fd);
+    }
+
+    if (path != NULL) {
+        execv(path, proc->argv);
+    }
+    fprintf(stderr, "mysh: %s: command not found\n", proc->argv[0]);
+    _exit(127);
+}
+
+// Writes the whole buffer to fd
+int write_all(int fd, char *buffer, ssize_t count) {
+    ssize_t written, offset;
+
+    for (offset = 0; offset < count; offset += written) {
+        written = write(fd, buffer + offset, count - offset);
+        if (written < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Copies everything left in in_fd to out_fd and the files with plain reads
+// and writes, used when one side of a tee stage can not be spliced
+int copy_fd(int in_fd, int out_fd, int *files, int nr_files) {
+    char buffer[COMMAND_BUFSIZE * 64];
+    ssize_t count;
+    int i;
+
+    while ((count = read(in_fd, buffer, sizeof(buffer))) > 0) {
+        for (i = 0; i < nr_files; i++) {
+            write_all(files[i], buffer, count);
+        }
+        if (write_all(out_fd, buffer, count) < 0) {
+            return -1;
+        }
+    }
+
+    return count < 0 ? -1 : 0;
+}
+
+// Moves exactly count bytes from a pipe into fd with splice
+int splice_all(int pipe_fd, int fd, ssize_t count) {
+    ssize_t moved;
+
+    while (count > 0) {
+        moved = splice(pipe_fd, NULL, fd, NULL, count, SPLICE_F_MOVE);
+        if (moved <= 0) {
+            return -1;
+        }
+        count -= moved;
+    }
+
+    return 0;
+}
+
+// Tells whether fd takes spliced data. Terminals and files opened for
+// appending refuse it
+int splice_target(int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || S_ISCHR(st.st_mode)) {
+        return 0;
+    }
+    return !(fcntl(fd, F_GETFL) & O_APPEND);
+}
+
+// Size of a pipe after asking for size, the kernel may refuse to grow it
+int grow_pipe(int fd, int size) {
+    int actual = fcntl(fd, F_SETPIPE_SZ, size);
+
+    return actual > 0 ? actual : fcntl(fd, F_GETPIPE_SZ);
+}
+
+// Body of a shell-side tee stage. Each chunk is spliced from the input into
+// a private pipe, duplicated into a scratch pipe with tee(2) and spliced to
+// every file, then spliced on to the next stage, so the data never enters
+// user space. Input or output that can not be spliced is copied instead
+void zerocopy_tee(int in_fd, int out_fd, int *files, int nr_files) {
+    int data[2], scratch[2], chunk, i;
+    ssize_t count, piece, teed;
+
+    for (i = 0; i < nr_files && splice_target(files[i]); i++) {
+    }
+    if (i < nr_files || !splice_target(out_fd)) {
+        _exit(copy_fd(in_fd, out_fd, files, nr_files) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    if (pipe(data) < 0 || pipe(scratch) < 0) {
+        _exit(EXIT_FAILURE);
+    }
+    // A chunk never holds more than the scratch pipe can take in one tee
+    chunk = grow_pipe(data[1], shell->pipe_size);
+    i = grow_pipe(scratch[1], shell->pipe_size);
+    if (chunk <= 0 || i <= 0) {
+        _exit(EXIT_FAILURE);
+    }
+    if (i < chunk) {
+        chunk = i;
+    }
+
+    while ((count = splice(in_fd, NULL, data[1], NULL, chunk, SPLICE_F_MOVE)) > 0) {
+        // tee may duplicate less than asked, so the chunk goes out in pieces.
+        // The first file's tee sizes each piece. The scratch pipe is empty
+        // again by the next tee, so the other files get the whole piece
+        while (count > 0) {
+            piece = count;
+            for (i = 0; i < nr_files; i++) {
+                teed = tee(data[0], scratch[1], piece, 0);
+                if (teed <= 0 || (i > 0 && teed != piece) || splice_all(scratch[0], files[i], teed) < 0) {
+                    fprintf(stderr, "tee: write error\n");
+                    _exit(EXIT_FAILURE);
+                }
+                piece = teed;
+            }
+            if (splice_all(data[0], out_fd, piece) < 0) {
+                _exit(EXIT_FAILURE);
+            }
+            count -= piece;
+        }
+    }
+
+    // Input that can not be spliced from, like a terminal, is copied instead
+    if (count < 0) {
+        copy_fd(in_fd, out_fd, files, nr_files);
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+// Runs `tee [-a] FILE...` inside a forked copy of the shell instead of the
+// external tee. Needs fork since the child runs shell code, not an exec
+pid_t fork_tee_stage(struct job *job, struct process *proc, int in_fd, int out_fd) {
+    pid_t childpid = fork();
+    int i, flags = O_CREAT | O_WRONLY | O_TRUNC, nr_files = 0;
+    int files[proc->argc];
+
+    if (childpid < 0) {
+        return -1;
+    } else if (childpid > 0) {
+        // Set it from both sides so the group exists whichever runs first
+        setpgid(childpid, job->pgid > 0 ? job->pgid : childpid);
+        return childpid;
+    }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    setpgid(0, job->pgid > 0 ? job->pgid : 0);
+    apply_job_limits(job, 0);
+
+    // Keep only the stage's own ends, a stray pipe end would hide EOF or EPIPE
+    dup2(in_fd, 0);
+    dup2(out_fd, 1);
+    close_range(3, ~0U, 0);
+    in_fd = 0;
+    out_fd = 1;
+
+    for (i = 1; i < proc->argc; i++) {
+        if (strcmp(proc->argv[i], "-a") == 0) {
+            flags = O_CREAT | O_WRONLY | O_APPEND;
+        } else if ((files[nr_files] = open(proc->argv[i], flags, 0644)) < 0) {
+            fprintf(stderr, "tee: %s: could not open file\n", proc->argv[i]);
+        } else {
+            nr_files++;
+        }
+    }
+
+    zerocopy_tee(in_fd, out_fd, files, nr_files);
+    return -1;
+}
+
+int launch_process(struct job *job, struct process *proc, int in_fd, int out_fd, int mode) {
+    proc->status = STATUS_RUNNING;
+    if (proc->type != COMMAND_EXTERNAL && execute_builtin_command(proc)) {
+        return 0;
+    }
+
+    pid_t childpid;
+    int status = 0, forked = 0;
+    uint64_t launched = trace_now();
+
+    // In zero-copy mode tee is run by the shell itself with splice and tee
+    if (shell->pipe_size > 0 && strcmp(proc->argv[0], "tee") == 0) {
+        childpid = fork_tee_stage(job, proc, in_fd, out_fd);
+        forked = 1;
+    } else if (limits_active(&job->limits)) {
+        // The limits have to be in place before the command starts
+        childpid = spawn_limited(job, proc, in_fd, out_fd);
+        forked = 1;
+    } else {
+        childpid = spawn_process(job, proc, in_fd, out_fd);
+    }
+
+    if (childpid < 0 && forked) {
+        perror("mysh: fork");
+        proc->status = STATUS_DONE;
+        trace_event('i', 0, job->id, trace_now(), 0, "fork failed");
+    } else if (childpid < 0) {
+        printf("mysh: %s: command not found\n", proc->argv[0]);
+        proc->status = STATUS_DONE;
+        trace_event('i', 0, job->id, trace_now(), 0, "command not found");
+    } else {
+        proc->pid = childpid;
+        clock_gettime(CLOCK_MONOTONIC, &proc->started);
+        // Launch overhead on the shell's track, the child gets its own
+        trace_event('X', 0, job->id, launched, timespec_ns(&proc->started) - launched, forked ? "fork" : "spawn");
+        trace_event('B', childpid, job->id, timespec_ns(&proc->started), 0, proc->command);
+        if (job->id > 0) {
+            proc->job_id = job->id;
+            insert_pid(proc);
+        }
+        if (job->pgid < 0) {
+            job->pgid = proc->pid;
+        }
+    }
+
+    // The child has its own copies now. Holding on to a pipe end here would
+    // keep the writer from ever seeing the reader go away
+    if (in_fd != 0) {
+        close(in_fd);
+    }
+    if (out_fd != 1) {
+        close(out_fd);
+    }
+
+    if (mode == FOREGROUND_EXECUTION && job->pgid > 0) {
+        tcsetpgrp(0, job->pgid);
+        status = wait_for_job(job->id);
+        signal(SIGTTOU, SIG_IGN);
+        tcsetpgrp(0, getpid());
+        signal(SIGTTOU, SIG_DFL);
+    }
+
+    return status;
+}
+
+// Starts the processes of a job, job_id is its id in the job table or -1
+// for a builtin
+int start_job(struct job *job, int job_id) {
+    struct process *proc;
+    int status = 0, in_fd = 0, fd[2];
+
+    if (job->root->type == COMMAND_EXTERNAL) {
+        prepare_job_limits(job);
+        if (job->mode == BACKGROUND_EXECUTION) {
+            shell->nr_background++;
+        }
+    }
+
+    for (proc = job->root; proc != NULL; proc = proc->next) {
+        if (proc == job->root && proc->input_path != NULL) {
+            in_fd = open(proc->input_path, O_RDONLY | O_CLOEXEC);
+            if (in_fd < 0) {
+                printf("mysh: no such file or directory: %s\n", proc->input_path);
+                if (remove_job(job_id) < 0) {
+                    free_job(job);
+                }
+                return -1;
+            }
+        }
+        if (proc->next != NULL) {
+            // Close-on-exec so no other child keeps a stray copy of either end
+            pipe2(fd, O_CLOEXEC);
+            trace_event('i', 0, job_id, trace_now(), 0, "pipe");
+            if (shell->pipe_size > 0) {
+                fcntl(fd[1], F_SETPIPE_SZ, shell->pipe_size);
+            }
+            status = launch_process(job, proc, in_fd, fd[1], PIPELINE_EXECUTION);
+            in_fd = fd[0];
+        } else {
+            int out_fd = 1;
+            if (proc->output_path != NULL) {
+                out_fd = open(proc->output_path, O_CREAT|O_WRONLY|O_CLOEXEC|(proc->append ? O_APPEND : O_TRUNC),
+                    S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+                if (out_fd < 0) {
+                    out_fd = 1;
+                }
+            }
+            status = launch_process(job, proc, in_fd, out_fd, job->mode);
+        }
+    }
+
+    if (job->root->type == COMMAND_EXTERNAL) {
+        if (status >= 0 && job->mode == FOREGROUND_EXECUTION) {
+            remove_job(job_id);
+        } else if (job->mode == BACKGROUND_EXECUTION) {
+            //print_processes_of_job(job_id);
+        }
+    } else {
+        // Builtin jobs never go into the job table
+        free_job(job);
+    }
+
+    return status;
+}
+
+// Starts queued background jobs while there are free slots
+void start_queued_jobs() {
+    struct job *job;
+
+    while (shell->queue_head != NULL
+            && (shell->max_background == 0 || shell->nr_background < shell->max_background)) {
+        job = shell->queue_head;
+        shell->queue_head = job->queue_next;
+        if (shell->queue_head == NULL) {
+            shell->queue_tail = NULL;
+        }
+        job->queued = 0;
+        trace_event('i', 0, job->id, trace_now(), 0, "job dequeued");
+        start_job(job, job->id);
+    }
+}
+
+int launch_job(struct job *job) {
+    struct process *proc;
+    int job_id = -1;
+
+    check_zombie();
+    if (job->root->type != COMMAND_EXTERNAL) {
+        return start_job(job, job_id);
+    }
+
+    job_id = insert_job(job);
+    if (shell->group != NULL) {
+        job->group = arena_strdup(&job->arena, shell->group);
+    }
+    // Past jobmax a background job waits for a running one to finish
+    if (job->mode == BACKGROUND_EXECUTION && shell->max_background > 0
+            && (shell->nr_background >= shell->max_background || shell->queue_head != NULL)) {
+        for (proc = job->root; proc != NULL; proc = proc->next) {
+            proc->status = STATUS_QUEUED;
+        }
+        job->queued = 1;
+        if (shell->queue_tail != NULL) {
+            shell->queue_tail->queue_next = job;
+        } else {
+            shell->queue_head = job;
+        }
+        shell->queue_tail = job;
+        trace_event('i', 0, job_id, trace_now(), 0, "job queued");
+        return 0;
+    }
+
+    return start_job(job, job_id);
+}
+
+// Splits a line into words and operators in a single pass. Quotes and
+// backslashes are removed while the words are written back into the line
+// itself, so no word is copied anywhere else. Operator tokens point at
+// static strings. tokens needs room for strlen(line) + 1 entries.
+// Returns the number of tokens, or -1 for an unterminated quote
+int lex_line(char *line, struct token *tokens) {
+    char *r = line, *w, delim;
+    int count = 0, quoted;
+
+    while (1) {
+        while (*r == ' ' || *r == '\t' || *r == '\r' || *r == '\n' || *r == '\a') {
+            r++;
+        }
+        if (*r == '\0') {
+            return count;
+        }
+
+        tokens[count].start = r - line;
+        tokens[count].quoted = 0;
+
+        // 2> only counts as an operator at the start of a token
+        if (r[0] == '2' && r[1] == '>') {
+            tokens[count].type = TOKEN_ERROR;
+            tokens[count].text = OPERATOR_STRING[TOKEN_ERROR];
+            r += 2;
+            tokens[count++].end = r - line;
+            continue;
+        }
+        if (*r == '|' || *r == '<' || *r == '>' || *r == '&') {
+            delim = *r;
+        } else {
+            // Copy the word onto itself, dropping quotes and escapes
+            w = r;
+            quoted = 0;
+            tokens[count].text = w;
+            tokens[count].type = TOKEN_WORD;
+            while (*r != '\0' && *r != ' ' && *r != '\t' && *r != '\r' && *r != '\n' && *r != '\a' &&
+                   *r != '|' && *r != '<' && *r != '>' && *r != '&') {
+                if (*r == '\'') {
+                    quoted = 1;
+                    for (r++; *r != '\'' && *r != '\0'; ) {
+                        *w++ = *r++;
+                    }
+                    if (*r++ == '\0') {
+                        return -1;
+                    }
+                } else if (*r == '"') {
+                    quoted = 1;
+                    for (r++; *r != '"' && *r != '\0'; ) {
+                        if (*r == '\\' && (r[1] == '"' || r[1] == '\\' || r[1] == '$' || r[1] == '`')) {
+                            r++;
+                        }
+                        *w++ = *r++;
+                    }
+                    if (*r++ == '\0') {
+                        return -1;
+                    }
+                } else if (*r == '\\' && r[1] != '\0') {
+                    quoted = 1;
+                    r++;
+                    *w++ = *r++;
+                } else {
+                    *w++ = *r++;
+                }
+            }
+
+            // Terminating the word may overwrite the operator after it
+            delim = *r;
+            tokens[count].end = r - line;
+            tokens[count++].quoted = quoted;
+            *w = '\0';
+            if (delim != '|' && delim != '<' && delim != '>' && delim != '&') {
+                if (delim != '\0') {
+                    r++;
+                }
+                continue;
+            }
+            tokens[count].start = r - line;
+            tokens[count].quoted = 0;
+        }
+
+        if (delim == '>' && r[1] == '>') {
+            tokens[count].type = TOKEN_APPEND;
+            r += 2;
+        } else {
+            tokens[count].type = delim == '|' ? TOKEN_PIPE :
+                                 delim == '<' ? TOKEN_INPUT :
+                                 delim == '>' ? TOKEN_OUTPUT : TOKEN_BACKGROUND;
+            r++;
+        }
+        tokens[count].text = OPERATOR_STRING[tokens[count].type];
+        tokens[count++].end = r - line;
+    }
+}
+
+// Orders directory entries by name
+int dir_entry_compare(const void *a, const void *b, void *names) {
+    return strcmp((char*) names + ((const struct dir_entry*) a)->name, (char*) names + ((const struct dir_entry*) b)->name);
+}
+
+// Reads the entries of the directory open on fd into listing, leaving out
+// . and .., and closes fd
+int read_listing(struct dir_listing *listing, int fd) {
+    DIR *dir = fdopendir(fd);
+    struct dirent *ent;
+    size_t len, used = 0;
+
+    if (dir == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    listing->count = 0;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0' || (ent->d_name[1] == '.' && ent->d_name[2] == '\0'))) {
+            continue;
+        }
+        len = strlen(ent->d_name) + 1;
+        if (used + len > listing->names_size) {
+            listing->names_size = (used + len) * 2;
+            listing->names = (char*) realloc(listing->names, listing->names_size);
+        }
+        if (listing->count == listing->entries_size) {
+            listing->entries_size = listing->entries_size > 0 ? listing->entries_size * 2 : TOKEN_BUFSIZE;
+            listing->entries = (struct dir_entry*) realloc(listing->entries, listing->entries_size * sizeof(struct dir_entry));
+        }
+        if (!listing->names || !listing->entries) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(listing->names + used, ent->d_name, len);
+        listing->entries[listing->count].name = used;
+        listing->entries[listing->count].type = ent->d_type;
+        listing->count++;
+        used += len;
+    }
+    closedir(dir);
+
+    qsort_r(listing->entries, listing->count, sizeof(struct dir_entry), dir_entry_compare, listing->names);
+    return 0;
+}
+
+// Returns the pinned listing of a directory, from the cache while the
+// directory is unchanged, NULL if it cannot be read
+struct dir_listing *list_directory(const char *path) {
+    struct dir_listing *listing = NULL, *victim = NULL;
+    struct stat st;
+    struct timespec now;
+    int fd, i;
+
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    for (i = 0; i < GLOB_CACHE_SIZE && listing == NULL; i++) {
+        if (glob_cache[i].path != NULL && strcmp(glob_cache[i].path, path) == 0) {
+            listing = &glob_cache[i];
+        } else if (glob_cache[i].pins == 0 && (victim == NULL || glob_cache[i].used < victim->used)) {
+            victim = &glob_cache[i];
+        }
+    }
+
+    if (listing != NULL && (listing->pins > 0 || (!listing->racy && listing->dev == st.st_dev
+            && listing->ino == st.st_ino && listing->mtime.tv_sec == st.st_mtim.tv_sec
+            && listing->mtime.tv_nsec == st.st_mtim.tv_nsec))) {
+        close(fd);
+        listing->pins++;
+        listing->used = ++glob_clock;
+        return listing;
+    }
+
+    if (listing == NULL && victim == NULL) {
+        // Every slot is being walked, this one lives until it is released
+        listing = (struct dir_listing*) calloc(1, sizeof(struct dir_listing));
+        if (!listing) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    } else if (listing == NULL) {
+        listing = victim;
+        free(listing->path);
+        listing->path = strdup(path);
+        if (!listing->path) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (read_listing(listing, fd) < 0) {
+        if (listing->path == NULL) {
+            free(listing->names);
+            free(listing->entries);
+            free(listing);
+        } else {
+            free(listing->path);
+            listing->path = NULL;
+        }
+        return NULL;
+    }
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->racy = (now.tv_sec - st.st_mtim.tv_sec) * 1000000000LL + now.tv_nsec - st.st_mtim.tv_nsec < GLOB_RACY_NS;
+    listing->pins = 1;
+    listing->used = ++glob_clock;
+    return listing;
+}
+
+// Unpins a listing, freeing it if it never made it into the cache
+void release_listing(struct dir_listing *listing) {
+    listing->pins--;
+    if (listing->path == NULL) {
+        free(listing->names);
+        free(listing->entries);
+        free(listing);
+    }
 }
 
-int shell_barrier() {
-    int i;
+// Compiles the bracket expression at the start of pattern into op, returns
+// its length or 0 when it is not closed
+size_t compile_set(struct arena *arena, const char *pattern, struct glob_op *op) {
+    const char *p = pattern + 1, *end;
+    unsigned char *set;
+    int negate = 0, c, i;
+
+    if (*p == '!' || *p == '^') {
+        negate = 1;
+        p++;
+    }
+    // A ] right after the [ is part of the set, ranges never end on one
+    if ((end = strchr(*p == ']' ? p + 1 : p, ']')) == NULL) {
+        return 0;
+    }
 
-     for (i = 1; i <= NR_JOBS; i++) {
-        if (shell->jobs[i] != NULL) {
-            wait_for_job(i); 
+    set = (unsigned char*) arena_alloc(arena, 32);
+    memset(set, 0, 32);
+    if (*p == ']') {
+        set[']' >> 3] |= 1 << (']' & 7);
+        p++;
+    }
+    while (p < end) {
+        if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+            for (c = (unsigned char) p[0]; c <= (unsigned char) p[2]; c++) {
+                set[c >> 3] |= 1 << (c & 7);
+            }
+            p += 3;
+        } else {
+            c = (unsigned char) *p++;
+            set[c >> 3] |= 1 << (c & 7);
         }
     }
+    if (negate) {
+        for (i = 0; i < 32; i++) {
+            set[i] = ~set[i];
+        }
+    }
+    set[0] &= ~1;
 
-    return 0;
+    op->type = GLOB_SET;
+    op->set = set;
+    return p + 1 - pattern;
 }
 
-// Checks to see if commands are builtin
-int get_command_type(char *command) {
-    if (strcmp(command, "quit") == 0) {
-        return COMMAND_QUIT;
-    } else if (strcmp(command, "cd") == 0) {
-        return COMMAND_CD;
-    } else if (strcmp(command, "barrier") == 0) {
-        return COMMAND_BARRIER;
-    } else {
-        return COMMAND_EXTERNAL;
+// Compiles one component of a pattern, it is literal when it has no
+// wildcards and a globstar when it is exactly **
+void compile_component(struct arena *arena, struct glob_component *comp) {
+    char *p = comp->text;
+    struct glob_op *op;
+    size_t len;
+
+    comp->ops = (struct glob_op*) arena_alloc(arena, (strlen(p) + 1) * sizeof(struct glob_op));
+    comp->nr_ops = 0;
+    comp->literal = 1;
+    comp->globstar = strcmp(p, "**") == 0;
+
+    while (*p != '\0') {
+        op = &comp->ops[comp->nr_ops];
+        if (*p == '*') {
+            while (*p == '*') {
+                p++;
+            }
+            op->type = GLOB_STAR;
+        } else if (*p == '?') {
+            op->type = GLOB_ANY;
+            p++;
+        } else if (*p == '[' && (len = compile_set(arena, p, op)) > 0) {
+            p += len;
+        } else if (comp->nr_ops > 0 && op[-1].type == GLOB_LITERAL) {
+            op[-1].len++;
+            p++;
+            continue;
+        } else {
+            op->type = GLOB_LITERAL;
+            op->text = p++;
+            op->len = 1;
+        }
+        if (op->type != GLOB_LITERAL) {
+            comp->literal = 0;
+        }
+        comp->nr_ops++;
     }
 }
 
-char* whitespace_strtrim(char* line) {
-    char *head = line, *tail = line + strlen(line);
+// Matches a name against a compiled component. On a mismatch only the
+// latest star is moved on, earlier stars could not match any better
+int glob_match(struct glob_component *comp, const char *name) {
+    struct glob_op *op = comp->ops, *end = comp->ops + comp->nr_ops, *star = NULL;
+    const char *s = name, *star_s = NULL;
+    unsigned char c;
+    size_t len;
 
-    while (*head == ' ') {
-        head++;
+    // Hidden names only match a pattern that starts with a dot
+    if (name[0] == '.' && (op == end || op->type != GLOB_LITERAL || op->text[0] != '.')) {
+        return 0;
     }
-    while (*tail == ' ') {
-        tail--;
+    // Cheap reject on a literal tail, like the .html of *.html
+    if (op != end && end[-1].type == GLOB_LITERAL) {
+        len = strlen(name);
+        if (len < end[-1].len || memcmp(name + len - end[-1].len, end[-1].text, end[-1].len) != 0) {
+            return 0;
+        }
     }
-    *(tail + 1) = '\0';
 
-    return head;
+    while (1) {
+        c = (unsigned char) *s;
+        if (op == end) {
+            if (c == '\0') {
+                return 1;
+            }
+        } else if (op->type == GLOB_STAR) {
+            if (op + 1 == end) {
+                return 1;
+            }
+            star = ++op;
+            star_s = s;
+            continue;
+        } else if (op->type == GLOB_LITERAL) {
+            if (strncmp(s, op->text, op->len) == 0) {
+                s += op->len;
+                op++;
+                continue;
+            }
+        } else if (c != '\0' && (op->type == GLOB_ANY || (op->set[c >> 3] >> (c & 7) & 1))) {
+            s++;
+            op++;
+            continue;
+        }
+
+        if (star == NULL || *star_s == '\0') {
+            return 0;
+        }
+        op = star;
+        s = ++star_s;
+    }
 }
 
-int execute_builtin_command(struct process *proc) {
-    int status = 1;
+// Whether a path is a directory, type being its d_type when known.
+// Symlinks to directories count only if follow is set
+int glob_is_dir(const char *path, unsigned char type, int follow) {
+    struct stat st;
 
-    switch (proc->type) {
-        case COMMAND_QUIT:
-            shell_quit();
-            break;
-        case COMMAND_CD:
-            shell_cd(proc->argc, proc->argv);
-            break;
-        case COMMAND_BARRIER:
-            shell_barrier(proc->pid);
-            break; 
-        default:
-            status = 0;
-            break;
+    if (type == DT_DIR) {
+        return 1;
     }
-
-    return status;
+    if (type != DT_UNKNOWN && (type != DT_LNK || !follow)) {
+        return 0;
+    }
+    if ((follow ? stat(path, &st) : lstat(path, &st)) < 0) {
+        return 0;
+    }
+    return S_ISDIR(st.st_mode);
 }
 
-int launch_process(struct job *job, struct process *proc, int in_fd, int out_fd, int mode) {
-    proc->status = STATUS_RUNNING;
-    if (proc->type != COMMAND_EXTERNAL && execute_builtin_command(proc)) {
-        return 0;
+// Adds a word to the glob results, slash appends a / to it
+void glob_result(const char *text, size_t len, int slash) {
+    struct glob_results *results = &glob_results;
+
+    if (results->len + len + 2 > results->size) {
+        results->size = (results->len + len + 2) * 2;
+        results->buf = (char*) realloc(results->buf, results->size);
+    }
+    if (results->count == results->offsets_size) {
+        results->offsets_size = results->offsets_size > 0 ? results->offsets_size * 2 : TOKEN_BUFSIZE;
+        results->offsets = (size_t*) realloc(results->offsets, results->offsets_size * sizeof(size_t));
+    }
+    if (!results->buf || !results->offsets) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
     }
 
-    pid_t childpid;
-    int status = 0;
+    results->offsets[results->count++] = results->len;
+    memcpy(results->buf + results->len, text, len);
+    results->len += len;
+    if (slash) {
+        results->buf[results->len++] = '/';
+    }
+    results->buf[results->len++] = '\0';
+}
 
-    childpid = fork();
+// Orders glob results by path
+int glob_result_compare(const void *a, const void *b, void *buf) {
+    return strcmp((char*) buf + *(const size_t*) a, (char*) buf + *(const size_t*) b);
+}
 
-    if (childpid < 0) {
-        return -1;
-    } else if (childpid == 0) {
-        signal(SIGINT, SIG_DFL);
-        signal(SIGQUIT, SIG_DFL);
-        signal(SIGTSTP, SIG_DFL);
-        signal(SIGTTIN, SIG_DFL);
-        signal(SIGTTOU, SIG_DFL);
-        signal(SIGCHLD, SIG_DFL);
+// Appends a name to the walk's path, returns the new length or 0 when the
+// path gets too long
+size_t glob_append(struct glob_walk *walk, size_t len, const char *name) {
+    size_t name_len = strlen(name);
+    int slash = len > 0 && walk->path[len - 1] != '/';
 
-        proc->pid = getpid();
-        if (job->pgid > 0) {
-            setpgid(0, job->pgid);
-        } else {
-            job->pgid = proc->pid;
-            setpgid(0, job->pgid);
-        }
+    if (len + slash + name_len + 1 > sizeof(walk->path)) {
+        return 0;
+    }
+    if (slash) {
+        walk->path[len++] = '/';
+    }
+    memcpy(walk->path + len, name, name_len + 1);
+    return len + name_len;
+}
 
-        if (in_fd != 0) {
-            dup2(in_fd, 0);
-            close(in_fd);
+// Matches the components from comp on inside the directory in the first
+// len bytes of the walk's path, no bytes being the current directory.
+// checked is 0 once a literal component was taken without looking
+void glob_walk_from(struct glob_walk *walk, size_t len, int comp, int checked) {
+    struct glob_component *c = &walk->comps[comp];
+    struct dir_listing *listing;
+    struct dir_entry *entry;
+    struct stat st;
+    size_t i, next;
+    int last = comp + 1 == walk->nr_comps, is_dir;
+
+    walk->path[len] = '\0';
+    if (comp == walk->nr_comps) {
+        if (!checked && (walk->dir_only ? !glob_is_dir(walk->path, DT_UNKNOWN, 1) : lstat(walk->path, &st) < 0)) {
+            return;
         }
+        glob_result(walk->path, len, walk->dir_only);
+        return;
+    }
 
-        if (out_fd != 1) {
-            dup2(out_fd, 1);
-            close(out_fd);
+    if (c->literal) {
+        if ((next = glob_append(walk, len, c->text)) > 0) {
+            glob_walk_from(walk, next, comp + 1, 0);
         }
+        return;
+    }
+
+    if ((listing = list_directory(len == 0 ? "." : walk->path)) == NULL) {
+        return;
+    }
 
-        if (execvp(proc->argv[0], proc->argv) < 0) {
-            printf("shell: %s: command not found\n", proc->argv[0]);
-            exit(0);
+    // ** stands for any number of directories, none included
+    if (c->globstar && !last) {
+        glob_walk_from(walk, len, comp + 1, checked);
+    }
+
+    for (i = 0; i < listing->count; i++) {
+        entry = &listing->entries[i];
+        if (c->globstar ? listing->names[entry->name] == '.' : !glob_match(c, listing->names + entry->name)) {
+            continue;
+        }
+        if ((next = glob_append(walk, len, listing->names + entry->name)) == 0) {
+            continue;
         }
 
-        exit(0);
-    } else {
-        proc->pid = childpid;
-        if (job->pgid > 0) {
-            setpgid(childpid, job->pgid);
-        } else {
-            job->pgid = proc->pid;
-            setpgid(childpid, job->pgid);
+        if (c->globstar) {
+            // Symlinks are not followed so a link cannot loop the walk
+            is_dir = glob_is_dir(walk->path, entry->type, 0);
+            if (last && (is_dir || !walk->dir_only)) {
+                glob_result(walk->path, next, walk->dir_only);
+            }
+            if (is_dir) {
+                glob_walk_from(walk, next, comp, 1);
+            }
+        } else if ((last && !walk->dir_only) || glob_is_dir(walk->path, entry->type, 1)) {
+            glob_walk_from(walk, next, comp + 1, 1);
         }
+    }
+    release_listing(listing);
+}
 
-        if (mode == FOREGROUND_EXECUTION) {
-            tcsetpgrp(0, job->pgid);
-            status = wait_for_job(job->id);
-            signal(SIGTTOU, SIG_IGN);
-            tcsetpgrp(0, getpid());
-            signal(SIGTTOU, SIG_DFL);
-        } 
+// Globs a word without braces into the glob results, a word without
+// wildcards or matches goes in as it is
+void glob_word(struct arena *arena, char *word) {
+    struct glob_walk walk;
+    char *copy = arena_strdup(arena, word), *p = copy;
+    size_t start = glob_results.count, len = 0;
+    int wildcards = 0, i;
+
+    walk.nr_comps = 1;
+    for (i = 0; word[i] != '\0'; i++) {
+        walk.nr_comps += word[i] == '/';
+    }
+    walk.comps = (struct glob_component*) arena_alloc(arena, walk.nr_comps * sizeof(struct glob_component));
+    walk.nr_comps = 0;
+    walk.dir_only = 0;
+    if (*p == '/') {
+        walk.path[len++] = '/';
     }
 
-    return status;
-}
+    while (*p != '\0') {
+        if (*p == '/') {
+            p++;
+            continue;
+        }
+        walk.comps[walk.nr_comps].text = p;
+        p += strcspn(p, "/");
+        if (*p == '/') {
+            *p++ = '\0';
+            walk.dir_only = *p == '\0';
+        }
+        compile_component(arena, &walk.comps[walk.nr_comps]);
+        wildcards += !walk.comps[walk.nr_comps].literal;
+        walk.nr_comps++;
+    }
 
-int launch_job(struct job *job) {
-    struct process *proc;
-    int status = 0, in_fd = 0, fd[2], job_id = -1;
+    if (wildcards > 0) {
+        glob_walk_from(&walk, len, 0, 1);
+    }
+    if (glob_results.count == start) {
+        glob_result(word, strlen(word), 0);
+        return;
+    }
 
-    check_zombie();
-    if (job->root->type == COMMAND_EXTERNAL) {
-        job_id = insert_job(job);
+    // Listings come sorted, so a single wildcard component gives sorted paths
+    for (i = 0; i < walk.nr_comps; i++) {
+        if (walk.comps[i].globstar) {
+            break;
+        }
+    }
+    if (wildcards > 1 || i < walk.nr_comps) {
+        qsort_r(glob_results.offsets + start, glob_results.count - start, sizeof(size_t), glob_result_compare, glob_results.buf);
     }
+}
 
-    for (proc = job->root; proc != NULL; proc = proc->next) {
-        if (proc == job->root && proc->input_path != NULL) {
-            in_fd = open(proc->input_path, O_RDONLY);
-            if (in_fd < 0) {
-                printf("mysh: no such file or directory: %s\n", proc->input_path);
-                remove_job(job_id);
-                return -1;
+// Expands the first brace pair of a word with a comma in it, {a,b}c giving
+// ac and bc, and the braces left in each of those. Every word this leaves
+// is globbed into the glob results
+void expand_braces(struct arena *arena, char *word) {
+    char *open, *close = NULL, *start, *p, *alt;
+    size_t prefix_len, suffix_len;
+    int depth, commas;
+
+    for (open = word; (open = strchr(open, '{')) != NULL; open++) {
+        depth = 0;
+        commas = 0;
+        for (p = open; *p != '\0'; p++) {
+            if (*p == '{') {
+                depth++;
+            } else if (*p == '}' && --depth == 0) {
+                break;
+            } else if (*p == ',' && depth == 1) {
+                commas++;
             }
         }
-        if (proc->next != NULL) {
-            pipe(fd);
-            status = launch_process(job, proc, in_fd, fd[1], PIPELINE_EXECUTION);
-            close(fd[1]);
-            in_fd = fd[0];
-        } else {
-            int out_fd = 1;
-            if (proc->output_path != NULL) {
-                out_fd = open(proc->output_path, O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
-                if (out_fd < 0) {
-                    out_fd = 1;
-                }
-            }
-            status = launch_process(job, proc, in_fd, out_fd, job->mode);
+        if (*p == '}' && commas > 0) {
+            close = p;
+            break;
         }
     }
+    if (close == NULL) {
+        glob_word(arena, word);
+        return;
+    }
 
-    if (job->root->type == COMMAND_EXTERNAL) {
-        if (status >= 0 && job->mode == FOREGROUND_EXECUTION) {
-            remove_job(job_id);
-        } else if (job->mode == BACKGROUND_EXECUTION) {
-            //print_processes_of_job(job_id);
+    prefix_len = open - word;
+    suffix_len = strlen(close + 1);
+    depth = 0;
+    for (start = p = open + 1; p <= close; p++) {
+        if (*p == '{') {
+            depth++;
+        } else if (*p == '}' && depth > 0) {
+            depth--;
+        } else if ((*p == ',' && depth == 0) || p == close) {
+            alt = (char*) arena_alloc(arena, prefix_len + (p - start) + suffix_len + 1);
+            memcpy(alt, word, prefix_len);
+            memcpy(alt + prefix_len, start, p - start);
+            memcpy(alt + prefix_len + (p - start), close + 1, suffix_len + 1);
+            expand_braces(arena, alt);
+            start = p + 1;
         }
     }
-
-    return status;
 }
 
-struct process *create_process(char *segment) {
-    int bufsize = TOKEN_BUFSIZE;
-    int position = 0;
-    char *command = strdup(segment);
-    char *token;
-    char **tokens = (char**) malloc(bufsize * sizeof(char*));
-
-    if (!tokens) {
-        fprintf(stderr, "mysh: allocation error\n");
-        exit(EXIT_FAILURE);
+// Prints the parse error for the token the parser stopped at
+void syntax_error(struct token *token) {
+    if (token == NULL) {
+        printf("mysh: syntax error near unexpected token `newline'\n");
+    } else {
+        printf("mysh: syntax error near unexpected token `%s'\n", token->text);
     }
+}
 
-    token = strtok(segment, TOKEN_DELIMITERS);
-    while (token != NULL) {
-        glob_t glob_buffer;
-        int glob_count = 0;
-        if (strchr(token, '*') != NULL || strchr(token, '?') != NULL) {
-            glob(token, 0, NULL, &glob_buffer);
-            glob_count = glob_buffer.gl_pathc;
-        }
-
-        if (position + glob_count >= bufsize) {
-            bufsize += TOKEN_BUFSIZE;
-            bufsize += glob_count;
-            tokens = (char**) realloc(tokens, bufsize * sizeof(char*));
-            if (!tokens) {
-                fprintf(stderr, "mysh: allocation error\n");
-                exit(EXIT_FAILURE);
+// Builds one pipeline stage from its tokens, source is the line as typed.
+// Unquoted words with wildcards or braces are expanded, redirections take
+// the next word
+struct process *create_process(struct arena *arena, char *source, struct token *tokens, int count) {
+    int bufsize = count + 1;
+    int position = 0, i;
+    char **argv = (char**) arena_alloc(arena, bufsize * sizeof(char*));
+    char *input_path = NULL, *output_path = NULL, *error_path = NULL;
+    int append = 0;
+
+    for (i = 0; i < count; i++) {
+        if (tokens[i].type != TOKEN_WORD) {
+            if (i + 1 >= count || tokens[i + 1].type != TOKEN_WORD) {
+                syntax_error(i + 1 < count ? &tokens[i + 1] : NULL);
+                return NULL;
             }
-        }
 
-        if (glob_count > 0) {
-            int i;
-            for (i = 0; i < glob_count; i++) {
-                tokens[position++] = strdup(glob_buffer.gl_pathv[i]);
+            switch (tokens[i].type) {
+                case TOKEN_INPUT:
+                    input_path = tokens[++i].text;
+                    break;
+                case TOKEN_OUTPUT:
+                case TOKEN_APPEND:
+                    append = tokens[i].type == TOKEN_APPEND;
+                    output_path = tokens[++i].text;
+                    break;
+                case TOKEN_ERROR:
+                    error_path = tokens[++i].text;
+                    break;
+                default:
+                    syntax_error(&tokens[i]);
+                    return NULL;
             }
-            globfree(&glob_buffer);
-        } else {
-            tokens[position] = token;
-            position++;
+            continue;
         }
 
-        token = strtok(NULL, TOKEN_DELIMITERS);
-    }
-
-    int i = 0, argc = 0;
-    char *input_path = NULL, *output_path = NULL;
-    while (i < position) {
-        if (tokens[i][0] == '<' || tokens[i][0] == '>') {
-            break;
-        }
-        i++;
-    }
-    argc = i;
+        if (!tokens[i].quoted && strpbrk(tokens[i].text, "*?[{") != NULL) {
+            size_t glob_count, j;
+            char *text;
+
+            glob_results.count = 0;
+            glob_results.len = 0;
+            expand_braces(arena, tokens[i].text);
+            glob_count = glob_results.count;
+
+            if (position + glob_count >= (size_t) bufsize) {
+                char **old_argv = argv;
+                bufsize += TOKEN_BUFSIZE;
+                bufsize += glob_count;
+                argv = (char**) arena_alloc(arena, bufsize * sizeof(char*));
+                memcpy(argv, old_argv, position * sizeof(char*));
+            }
 
-    for (; i < position; i++) {
-        if (tokens[i][0] == '<') {
-            if (strlen(tokens[i]) == 1) {
-                input_path = (char *) malloc((strlen(tokens[i + 1]) + 1) * sizeof(char));
-                strcpy(input_path, tokens[i + 1]);
-                i++;
-            } else {
-                input_path = (char *) malloc(strlen(tokens[i]) * sizeof(char));
-                strcpy(input_path, tokens[i] + 1);
-            }
-        } else if (tokens[i][0] == '>') {
-            if (strlen(tokens[i]) == 1) {
-                output_path = (char *) malloc((strlen(tokens[i + 1]) + 1) * sizeof(char));
-                strcpy(output_path, tokens[i + 1]);
-                i++;
-            } else {
-                output_path = (char *) malloc(strlen(tokens[i]) * sizeof(char));
-                strcpy(output_path, tokens[i] + 1);
+            // The words are copied into the arena in one go
+            text = (char*) arena_alloc(arena, glob_results.len);
+            memcpy(text, glob_results.buf, glob_results.len);
+            for (j = 0; j < glob_count; j++) {
+                argv[position++] = text + glob_results.offsets[j];
             }
-        } else {
-            break;
+            continue;
         }
+
+        argv[position++] = tokens[i].text;
     }
+    argv[position] = NULL;
 
-    for (i = argc; i <= position; i++) {
-        tokens[i] = NULL;
+    if (position == 0) {
+        syntax_error(count > 0 ? &tokens[0] : NULL);
+        return NULL;
     }
 
-    struct process *new_proc = (struct process*) malloc(sizeof(struct process));
-    new_proc->command = command;
-    new_proc->argv = tokens;
-    new_proc->argc = argc;
+    struct process *new_proc = (struct process*) arena_alloc(arena, sizeof(struct process));
+    new_proc->command = arena_strndup(arena, source + tokens[0].start, tokens[count - 1].end - tokens[0].start);
+    new_proc->argv = argv;
+    new_proc->argc = position;
     new_proc->input_path = input_path;
     new_proc->output_path = output_path;
+    new_proc->error_path = error_path;
+    new_proc->append = append;
     new_proc->pid = -1;
-    new_proc->type = get_command_type(tokens[0]);
+    new_proc->job_id = -1;
+    memset(&new_proc->started, 0, sizeof(new_proc->started));
+    memset(&new_proc->finished, 0, sizeof(new_proc->finished));
+    memset(&new_proc->usage, 0, sizeof(new_proc->usage));
+    new_proc->hash_next = NULL;
+    new_proc->type = get_command_type(argv[0]);
     new_proc->next = NULL;
     return new_proc;
 }
 
+// Parses a command line into a job, one process per pipeline stage.
+// Returns NULL for empty lines and syntax errors
 struct job *shell_parse_command(char *line) {
-    line = whitespace_strtrim(line);
-    char *command = strdup(line);
-
-    struct process *root_proc = NULL, *proc = NULL;
-    char *line_cursor = line, *c = line, *seg;
-    int seg_len = 0, mode = FOREGROUND_EXECUTION;
+    // Everything parsed for the job, the job included, goes into one arena
+    struct arena arena = { NULL };
+    struct job *new_job = (struct job*) arena_alloc(&arena, sizeof(struct job));
+    size_t len = strlen(line);
+    char *source = arena_strndup(&arena, line, len);
+    char *words = arena_strndup(&arena, line, len);
+    struct token *tokens = (struct token*) arena_alloc(&arena, (len + 1) * sizeof(struct token));
+    struct process *root_proc = NULL, *proc = NULL, *new_proc;
+    int count = lex_line(words, tokens), seg_start = 0, i;
+    int mode = FOREGROUND_EXECUTION, timed = 0, has_limits = 0;
+    struct job_limits limits = { 0, 0 };
+
+    if (count < 0) {
+        printf("mysh: unexpected end of line while looking for a matching quote\n");
+        arena_release(&arena);
+        return NULL;
+    }
 
-    if (line[strlen(line) - 1] == '&') {
+    if (count > 0 && tokens[count - 1].type == TOKEN_BACKGROUND) {
         mode = BACKGROUND_EXECUTION;
-        line[strlen(line) - 1] = '\0';
+        count--;
+    }
+    if (count == 0) {
+        arena_release(&arena);
+        return NULL;
     }
 
-    while (1) {
-        if (*c == '\0' || *c == '|') {
-            seg = (char*) malloc((seg_len + 1) * sizeof(char));
-            strncpy(seg, line_cursor, seg_len);
-            seg[seg_len] = '\0';
-
-            struct process* new_proc = create_process(seg);
-            if (!root_proc) {
-                root_proc = new_proc;
-                proc = root_proc;
-            } else {
-                proc->next = new_proc;
-                proc = new_proc;
-            }
+    // time in front of a pipeline reports on it once the job is over
+    if (tokens[0].type == TOKEN_WORD && !tokens[0].quoted && strcmp(tokens[0].text, "time") == 0) {
+        timed = 1;
+        tokens++;
+        count--;
+        if (count == 0) {
+            arena_release(&arena);
+            return NULL;
+        }
+    }
 
-            if (*c != '\0') {
-                line_cursor = c;
-                while (*(++line_cursor) == ' ');
-                c = line_cursor;
-                seg_len = 0;
-                continue;
-            } else {
-                break;
+    // limit mem=.. cpu=.. -- in front of a pipeline limits just that job,
+    // without the -- it is the builtin that sets the defaults
+    if (tokens[0].type == TOKEN_WORD && !tokens[0].quoted && strcmp(tokens[0].text, "limit") == 0) {
+        for (i = 1; i < count && tokens[i].type == TOKEN_WORD && strcmp(tokens[i].text, "--") != 0; i++) {
+        }
+        if (i < count && tokens[i].type == TOKEN_WORD) {
+            for (seg_start = 1; seg_start < i; seg_start++) {
+                if (parse_limit(tokens[seg_start].text, &limits) < 0) {
+                    arena_release(&arena);
+                    return NULL;
+                }
+            }
+            has_limits = 1;
+            tokens += i + 1;
+            count -= i + 1;
+            seg_start = 0;
+            if (count == 0) {
+                arena_release(&arena);
+                return NULL;
             }
+        }
+    }
+
+    for (i = 0; i <= count; i++) {
+        if (i < count && tokens[i].type == TOKEN_BACKGROUND) {
+            syntax_error(&tokens[i]);
+            arena_release(&arena);
+            return NULL;
+        }
+        if (i < count && tokens[i].type != TOKEN_PIPE) {
+            continue;
+        }
+        if (i == seg_start) {
+            syntax_error(i < count ? &tokens[i] : NULL);
+            arena_release(&arena);
+            return NULL;
+        }
+
+        new_proc = create_process(&arena, source, tokens + seg_start, i - seg_start);
+        if (new_proc == NULL) {
+            arena_release(&arena);
+            return NULL;
+        }
+
+        if (!root_proc) {
+            root_proc = new_proc;
+            proc = root_proc;
         } else {
-            seg_len++;
-            c++;
+            proc->next = new_proc;
+            proc = new_proc;
         }
+        seg_start = i + 1;
     }
 
-    struct job *new_job = (struct job*) malloc(sizeof(struct job));
+    new_job->id = -1;
     new_job->root = root_proc;
-    new_job->command = command;
+    new_job->command = arena_strndup(&arena, source + tokens[0].start, tokens[count - 1].end - tokens[0].start);
     new_job->pgid = -1;
     new_job->mode = mode;
+    new_job->timed = timed;
+    new_job->has_limits = has_limits;
+    new_job->limits = limits;
+    new_job->cgroup = NULL;
+    new_job->throttled_usec = 0;
+    new_job->queued = 0;
+    new_job->queue_next = NULL;
+    new_job->group = NULL;
+    new_job->arena = arena;
     return new_job;
 }
 
 // Reads in line from shell so we can parse it
 char *read_line(void) {
-    int buff_size = COMMAND_BUFSIZE;
-    int position = 0;
-    char *buffer = malloc(sizeof(char) *buff_size);
-    int c;
-
-    if(!buffer) {
-        fprintf(stderr, "shell: allocation error\n");
-        exit(EXIT_FAILURE);
-    }
+    ssize_t count;
+    int done = 0;
+    char *line;
 
-    // Read a character
-    while (1) {
-        c = getchar();
+    editor.len = 0;
+    editor.cursor = 0;
+    editor.escape = 0;
+    editor.history_pos = -1;
+    editor.searching = 0;
+    editor_reserve(COMMAND_BUFSIZE);
+
+    // Raw mode goes on before the prompt so no early key is seen cooked
+    editor_raw_mode(1);
+    display_prompt();
+
+    while (!done) {
+        if (editor.input_pos == editor.input_len) {
+            fflush(stdout);
+
+            // Ctrl-C drops the line, the handler already moved to a new one
+            if (wait_for_input() < 0) {
+                editor.len = 0;
+                editor.cursor = 0;
+                display_prompt();
+                continue;
+            }
 
-        // IF EOF replace with a null char and return
-        if (c == EOF || c == '\n') {
-            buffer[position] = '\0';
-            return buffer;
-        } else {
-            buffer[position] = c;
+            // Read as much as is there instead of a byte at a time
+            count = read(0, editor.input, READ_BUFSIZE);
+            if (count < 0 && errno == EINTR) {
+                editor.len = 0;
+                editor.cursor = 0;
+                display_prompt();
+                continue;
+            }
+            if (count <= 0) {
+                editor.eof = 1;
+                break;
+            }
+            editor.input_pos = 0;
+            editor.input_len = count;
         }
-        position++;
 
-        // If we have exceeded the buffer, reallocate
-        if (position >= buff_size) {
-            buff_size += COMMAND_BUFSIZE;
-            buffer = realloc(buffer, buff_size);
-
-            if (!buffer) {
-                fprintf(stderr, "shell: allocate error\n");
-                exit(EXIT_FAILURE);
-            }
+        done = editor.tty ? editor_feed() : editor_feed_plain();
+        if (editor.eof) {
+            break;
         }
     }
+    fflush(stdout);
+    editor_raw_mode(0);
+
+    // Nothing left to read, leave like quit would
+    if (editor.eof && editor.len == 0) {
+        printf("\n");
+        exit(0);
+    }
+    editor.eof = 0;
+
+    // The caller owns the line, the editor starts the next one afresh
+    editor.buf[editor.len] = '\0';
+    line = editor.buf;
+    editor.buf = NULL;
+    editor.size = 0;
+    return line;
 }
 
 // Loop for interactive mode, reads in from command line then executes commands
@@ -736,15 +3958,17 @@ void interactive_mode() {
     int status = 1;
 
     while (1) {
-        display_prompt();
-
         line = read_line();
-        if (strlen(line) == 0) {
-            check_zombie();
+        // Like other shells only interactive sessions keep history
+        if (editor.tty) {
+            history_add(line);
+        }
+        j = shell_parse_command(line);
+        free(line);
+        if (j == NULL) {
             continue;
         }
 
-        j = shell_parse_command(line);
         status = launch_job(j);
     }
 }
@@ -767,24 +3991,107 @@ void shell_init() {
     setpgid(pid, pid);
     tcsetpgrp(0, pid);
 
+    // SIGCHLD is only delivered through a signalfd watched by the event loop
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    // stdin stays unbuffered so epoll sees every pending byte
+    setvbuf(stdin, NULL, _IONBF, 0);
+
     shell = (struct shell_info*) malloc(sizeof(struct shell_info));
     getlogin_r(shell->cur_user, sizeof(shell->cur_user));
 
     struct passwd *pw = getpwuid(getuid());
     strcpy(shell->pw_dir, pw->pw_dir);
 
+    shell->jobs_size = JOB_TABLE_SIZE;
+    shell->max_job_id = 0;
+    shell->nr_free_ids = 0;
+    shell->jobs = (struct job**) calloc(shell->jobs_size + 1, sizeof(struct job*));
+    shell->free_ids = (int*) malloc((shell->jobs_size + 1) * sizeof(int));
+    if (!shell->jobs || !shell->free_ids) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    shell->pid_table_size = PID_TABLE_SIZE;
+    shell->nr_pids = 0;
+    shell->pid_table = (struct process**) calloc(shell->pid_table_size, sizeof(struct process*));
+    if (!shell->pid_table) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    shell->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    shell->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (shell->signal_fd < 0 || shell->epoll_fd < 0) {
+        perror("mysh: event loop");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event event = { .events = EPOLLIN };
+    event.data.fd = shell->signal_fd;
+    epoll_ctl(shell->epoll_fd, EPOLL_CTL_ADD, shell->signal_fd, &event);
+    event.data.fd = 0;
+    if (epoll_ctl(shell->epoll_fd, EPOLL_CTL_ADD, 0, &event) < 0) {
+        // Regular files can not be polled but are always readable
+        close(shell->epoll_fd);
+        shell->epoll_fd = -1;
+    }
+
     int i;
-    for (i = 0; i < NR_JOBS; i++) {
-        shell->jobs[i] = NULL;
+    for (i = 0; i < COMMAND_TABLE_SIZE; i++) {
+        shell->command_table[i] = NULL;
     }
+    shell->hashed_path = NULL;
+    shell->pipe_size = 0;
+    shell->usage_log = NULL;
+    shell->default_limits.mem = 0;
+    shell->default_limits.cpus = 0;
+    shell->cgroup_parent = NULL;
+    shell->cgroup_state = 0;
+    shell->cgroup_seq = 0;
+    shell->max_background = 0;
+    shell->nr_background = 0;
+    shell->queue_head = NULL;
+    shell->queue_tail = NULL;
+    shell->group = NULL;
 
     update_cwd_info();
+    history_open();
 
     // Update defualt terminal modes
     tcgetattr(0, &shell_tmodes);
+    editor.tty = isatty(0);
 }
 
 int main(int argc, char **argv) {
+    struct option long_options[] = {
+        { "trace", required_argument, NULL, 't' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt, fd;
+
+    // --trace FILE records a Chrome trace, a script argument replaces stdin
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        if (opt != 't' || trace_open(optarg) < 0) {
+            fprintf(stderr, "Usage: %s [--trace file] [script]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind > 1) {
+        fprintf(stderr, "Usage: %s [--trace file] [script]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (argc - optind == 1) {
+        if ((fd = open(argv[optind], O_RDONLY)) < 0 || dup2(fd, 0) < 0) {
+            fprintf(stderr, "mysh: %s: %s\n", argv[optind], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
 
     shell_init(); 
     interactive_mode();